@@ -98,7 +98,7 @@ $ADB push $STATIC_FILES_DIR/ec.ko "$DEVICE_DIR" || exit 1
 echo "* Starting traffic monitor. You might need to trigger a screen event (e.g. push the lock button) to get one event into the buffer to continue."
 $ADB shell "logcat -d -b main" > $LOGCAT_BEFORE_FILE
 $ADB shell "logcat -c"
-$ADB shell "insmod $DEVICE_DIR/ec.ko" > $INSMOD_OUTPUT_FILE
+$ADB shell "insmod $DEVICE_DIR/ec.ko display_burst_stage=1 dmesg_compat=1" > $INSMOD_OUTPUT_FILE
 
 insmod_errors=`grep "error" "$INSMOD_OUTPUT_FILE"`
 if [ "$insmod_errors" != "" ]; then
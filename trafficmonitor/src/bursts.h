@@ -0,0 +1,183 @@
+/* 
+ * This file is part of TrafficMonitor.
+ * 
+ * Copyright (C) 2011, Ahmad Nazir, Mohammad Hoque, Wei Li and Aki Saarinen.
+ * 
+ * TrafficMonitor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * TrafficMonitor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with TrafficMonitor.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef BURSTS_H_
+#define BURSTS_H_
+
+#include <linux/kernel.h>
+#include <linux/moduleparam.h>
+#include <linux/string.h>
+#include <linux/time.h>
+
+#include "events.h"
+
+/**
+ * Burst Summaries
+ *
+ * With burst_summary on the module does not send an
+ * event per packet. It groups the packets into bursts,
+ * as the energy models do afterwards, and sends one
+ * TM_EVENT_BURST record per burst instead: once per
+ * connection and once for the whole device
+ * (TM_EVENT_F_DEVICE).
+ *
+ * A burst ends when no packet has been seen for
+ * burst_gap_us. The burst of a connection is sent with
+ * the first packet after the gap, or by the flush work
+ * in ec.c if the connection stays quiet.
+ *
+ * The device burst is not kept in one place, which
+ * every packet on every CPU would have to lock. Each
+ * CPU keeps the burst of its own packets and queues the
+ * ones that end as parts. The flush work joins the
+ * parts of all CPUs that are less than burst_gap_us
+ * apart into the bursts of the device, so these are
+ * sent up to BURST_FLUSH_MS after they end.
+ */
+static bool burst_summary = false;
+module_param(burst_summary, bool, 0644);
+MODULE_PARM_DESC(burst_summary, "Send one event per burst instead of one per packet");
+
+static unsigned int burst_gap_us = 6000;
+module_param(burst_gap_us, uint, 0644);
+MODULE_PARM_DESC(burst_gap_us, "Silence that ends a burst (us)");
+
+// How often the bursts of quiet connections are looked for
+#define BURST_FLUSH_MS 100
+
+// Ended device burst parts a CPU keeps until the flush work takes them
+#define BURST_PARTS 8
+
+struct tm_burst {
+  u64 start;			// first packet
+  u64 end;				// last packet, kept after the burst is sent
+  u64 gap;				// from the end of the previous burst to 'start'
+  u_int32_t bytes[2];	// by direction, 0 uplink and 1 downlink
+  u_int32_t packets[2];	// segments on the wire
+};
+
+static inline void init_burst(struct tm_burst *burst)
+{
+  memset(burst, 0, sizeof(*burst));
+}
+
+static inline bool burst_open(const struct tm_burst *burst)
+{
+  return burst->packets[0] != 0 || burst->packets[1] != 0;
+}
+
+/*
+ * 'now' is read when the hook is entered, so a packet
+ * sent from process context can come after one sent
+ * from a softirq with an older time. A time at or
+ * before the end of the burst is inside it.
+ */
+static inline bool burst_ended(const struct tm_burst *burst, u64 now)
+{
+  return burst_open(burst) && now > burst->end
+    && now - burst->end > (u64) burst_gap_us * NSEC_PER_USEC;
+}
+
+/*
+ * Hand an ended burst over in 'done'. Only the end of
+ * the burst is kept, for the gap of the next one.
+ */
+static inline bool take_burst(struct tm_burst *burst, struct tm_burst *done, u64 now)
+{
+  if (!burst_ended(burst, now))
+    return false;
+
+  *done = *burst;
+  memset(burst->bytes, 0, sizeof(burst->bytes));
+  memset(burst->packets, 0, sizeof(burst->packets));
+  return true;
+}
+
+/*
+ * Add a packet to the burst. If the packet starts a
+ * new burst, the one it ends is handed over in 'done'
+ * and true is returned.
+ */
+static inline bool burst_add(struct tm_burst *burst, struct tm_burst *done, u64 now,
+                             u_int32_t size, u_int16_t segments, int direction)
+{
+  bool ended = take_burst(burst, done, now);
+
+  if (!burst_open(burst)) {
+    burst->gap = burst->end && now > burst->end ? now - burst->end : 0;
+    burst->start = now;
+    burst->end = now;
+  } else {
+    burst->start = min(burst->start, now);
+    burst->end = max(burst->end, now);
+  }
+
+  burst->bytes[direction] += size;
+  burst->packets[direction] += segments;
+  return ended;
+}
+
+/*
+ * Does 'part', which does not start before 'burst',
+ * belong to the same burst?
+ */
+static inline bool burst_joins(const struct tm_burst *burst, const struct tm_burst *part)
+{
+  return part->start <= burst->end + (u64) burst_gap_us * NSEC_PER_USEC;
+}
+
+/*
+ * Add the packets of 'part' to 'burst', which spans
+ * both afterwards.
+ */
+static inline void burst_merge(struct tm_burst *burst, const struct tm_burst *part)
+{
+  if (!burst_open(burst)) {
+    *burst = *part;
+    return;
+  }
+
+  burst->start = min(burst->start, part->start);
+  burst->end = max(burst->end, part->end);
+  burst->bytes[0] += part->bytes[0];
+  burst->bytes[1] += part->bytes[1];
+  burst->packets[0] += part->packets[0];
+  burst->packets[1] += part->packets[1];
+}
+
+static inline void fill_burst_event(struct tm_event *event, const struct tm_burst *burst,
+                                    u_int32_t connection_id, uid_t uid, pid_t pid, u_int8_t flags)
+{
+  memset(event, 0, sizeof(*event));
+  event->version = TM_EVENT_VERSION;
+  event->type = TM_EVENT_BURST;
+  event->flags = flags;
+  event->timestamp = burst->start;
+  event->gap = burst->gap;
+  event->connection_id = connection_id;
+  event->size = burst->bytes[0] + burst->bytes[1];
+  event->uid = uid;
+  event->pid = pid;
+  event->burst.end = burst->end;
+  memcpy(event->burst.bytes, burst->bytes, sizeof(event->burst.bytes));
+  memcpy(event->burst.packets, burst->packets, sizeof(event->burst.packets));
+}
+
+#endif /* BURSTS_H_ */
@@ -0,0 +1,348 @@
+/* 
+ * This file is part of TrafficMonitor.
+ * 
+ * Copyright (C) 2011, Ahmad Nazir, Mohammad Hoque, Wei Li and Aki Saarinen.
+ * 
+ * TrafficMonitor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * TrafficMonitor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with TrafficMonitor.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef CHOKE_H_
+#define CHOKE_H_
+
+#include <linux/debugfs.h>
+#include <linux/rcupdate.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/timer.h>
+
+#include "clock.h"
+#include "filter.h"
+
+/**
+ * Choke Policies
+ *
+ * Besides the global choke switch (TM_CMD_SET_CHOKE)
+ * single flows can be choked: a policy matches the
+ * local and remote port ranges and the owner of the
+ * local socket like a filter rule does, and holds
+ * until it is released (TM_CMD_RELEASE_CHOKE) or, if
+ * it was given a timeout, until its deadline passes.
+ * The receive window of every outgoing packet of a
+ * matching connection is set to zero.
+ *
+ * When a connection is no longer choked its next
+ * outgoing packet keeps the window the stack puts in
+ * it. The peer's zero window probes back off towards
+ * TCP_RTO_MAX, so that packet is not left to the next
+ * probe: the choke timer fires when the earliest
+ * deadline passes, and right away after a release or
+ * when the global switch goes off, and has every
+ * connection that is choked no more send an ACK with
+ * its current window (restore_unchoked_connections()
+ * in nfhooks.h).
+ *
+ * Like the filter the policies are replaced as a whole
+ * and read under RCU by the hooks; the writers are the
+ * generic netlink commands. Expired policies are
+ * dropped whenever the policies are changed.
+ */
+#define TM_CHOKE_MAX_POLICIES 64
+
+struct tm_choke_policy {
+  struct tm_filter_rule match;	// only the ports and the uid are used
+  u64 deadline;					// tm_now() time, 0 until released
+};
+
+struct tm_choke {
+  struct rcu_head rcu;
+  unsigned int count;
+  struct tm_choke_policy policies[0];
+};
+
+static struct tm_choke *tm_choke = NULL;
+static struct dentry *choke_file = NULL;
+
+static struct timer_list choke_timer;
+static DEFINE_SPINLOCK(choke_timer_lock);	// arming against stop_choke()
+static bool choke_timer_stopped = false;
+static void (*choke_restore)(void) = NULL;
+
+static inline bool choke_policy_active(const struct tm_choke_policy *policy, u64 now)
+{
+  return policy->deadline == 0 || now < policy->deadline;
+}
+
+/*
+ * Should the outgoing packet of the connection be
+ * choked by a policy? Called from the hooks, under
+ * rcu_read_lock().
+ */
+static inline bool choke_connection(const struct tm_flow_key *key, uid_t uid, u64 now)
+{
+  struct tm_choke *choke = rcu_dereference(tm_choke);
+  u_int16_t local_port, remote_port;
+  unsigned int i;
+
+  if (choke == NULL)
+    return false;
+
+  local_port = ntohs(key->local_port);
+  remote_port = ntohs(key->remote_port);
+
+  for (i = 0; i < choke->count; i++) {
+    const struct tm_choke_policy *policy = &choke->policies[i];
+
+    if (choke_policy_active(policy, now)
+        && filter_rule_matches(&policy->match, TM_FILTER_UPLINK, local_port, remote_port, 0, uid))
+      return true;
+  }
+
+  return false;
+}
+
+/*
+ * Fire the choke timer at 'expires' unless it is
+ * already due earlier.
+ */
+static void set_choke_timer(unsigned long expires)
+{
+  spin_lock_bh(&choke_timer_lock);
+  if (!choke_timer_stopped
+      && (!timer_pending(&choke_timer) || time_before(expires, choke_timer.expires)))
+    mod_timer(&choke_timer, expires);
+  spin_unlock_bh(&choke_timer_lock);
+}
+
+/*
+ * Restore the windows of the connections that are no
+ * longer choked, from the choke timer.
+ */
+static inline void restore_choked_soon(void)
+{
+  set_choke_timer(jiffies);
+}
+
+/*
+ * Arm the choke timer for the earliest deadline of the
+ * active policies, just after it has passed.
+ */
+static void arm_choke_deadline(void)
+{
+  struct tm_choke *choke;
+  u64 now = tm_now();
+  u64 deadline = 0;
+  unsigned int i;
+
+  rcu_read_lock();
+  choke = rcu_dereference(tm_choke);
+  for (i = 0; choke != NULL && i < choke->count; i++) {
+    const struct tm_choke_policy *policy = &choke->policies[i];
+
+    if (policy->deadline != 0 && choke_policy_active(policy, now)
+        && (deadline == 0 || policy->deadline < deadline))
+      deadline = policy->deadline;
+  }
+  rcu_read_unlock();
+
+  if (deadline != 0)
+    set_choke_timer(jiffies + msecs_to_jiffies(tm_ms_since(now, deadline)) + 1);
+}
+
+static void choke_timer_function(unsigned long data)
+{
+  choke_restore();
+  arm_choke_deadline();
+}
+
+static void free_choke_rcu(struct rcu_head *head)
+{
+  kfree(container_of(head, struct tm_choke, rcu));
+}
+
+static void replace_choke(struct tm_choke *choke)
+{
+  struct tm_choke *old = tm_choke;
+
+  rcu_assign_pointer(tm_choke, choke);
+  if (old != NULL)
+    call_rcu(&old->rcu, free_choke_rcu);
+}
+
+static inline bool same_choke_match(const struct tm_filter_rule *a, const struct tm_filter_rule *b)
+{
+  return a->local_port_min == b->local_port_min && a->local_port_max == b->local_port_max
+    && a->remote_port_min == b->remote_port_min && a->remote_port_max == b->remote_port_max
+    && a->uid == b->uid;
+}
+
+/*
+ * Build the new policies out of the current ones,
+ * leaving out the expired ones and those matching
+ * 'release', and appending 'add'. Either can be NULL.
+ */
+static int update_choke(const struct tm_choke_policy *add, const struct tm_filter_rule *release)
+{
+  struct tm_choke *old = tm_choke;
+  struct tm_choke *choke;
+  unsigned int count = old ? old->count : 0;
+  u64 now = tm_now();
+  unsigned int i;
+
+  choke = kmalloc(sizeof(struct tm_choke) + (count + 1) * sizeof(struct tm_choke_policy), GFP_KERNEL);
+  if (choke == NULL)
+    return -ENOMEM;
+
+  choke->count = 0;
+  for (i = 0; i < count; i++) {
+    const struct tm_choke_policy *policy = &old->policies[i];
+
+    if (!choke_policy_active(policy, now))
+      continue;
+    if (release != NULL && same_choke_match(&policy->match, release))
+      continue;
+    choke->policies[choke->count++] = *policy;
+  }
+
+  if (add != NULL) {
+    if (choke->count >= TM_CHOKE_MAX_POLICIES) {
+      kfree(choke);
+      return -ENOSPC;
+    }
+    choke->policies[choke->count++] = *add;
+  }
+
+  if (choke->count == 0) {
+    kfree(choke);
+    choke = NULL;
+  }
+
+  replace_choke(choke);
+  if (release != NULL)
+    restore_choked_soon();
+  arm_choke_deadline();
+  return 0;
+}
+
+/*
+ * Choke the matching connections, for 'timeout_ms' or
+ * until released if it is 0.
+ */
+static int add_choke_policy(const struct tm_filter_rule *match, u_int32_t timeout_ms)
+{
+  struct tm_choke_policy policy;
+
+  policy.match = *match;
+  policy.deadline = timeout_ms ? tm_now() + (u64) timeout_ms * NSEC_PER_MSEC : 0;
+  return update_choke(&policy, NULL);
+}
+
+/*
+ * Release the policies with exactly this match, or
+ * every policy if 'match' is NULL.
+ */
+static int release_choke_policies(const struct tm_filter_rule *match)
+{
+  if (match == NULL) {
+    replace_choke(NULL);
+    restore_choked_soon();
+    return 0;
+  }
+
+  return update_choke(NULL, match);
+}
+
+static int choke_show(struct seq_file *m, void *v)
+{
+  struct tm_choke *choke;
+  u64 now = tm_now();
+  unsigned int i;
+
+  rcu_read_lock();
+  choke = rcu_dereference(tm_choke);
+
+  for (i = 0; choke != NULL && i < choke->count; i++) {
+    const struct tm_choke_policy *policy = &choke->policies[i];
+
+    seq_printf(m, "local %u-%u remote %u-%u",
+               policy->match.local_port_min, policy->match.local_port_max,
+               policy->match.remote_port_min, policy->match.remote_port_max);
+    if (policy->match.uid != TM_UID_ANY)
+      seq_printf(m, " uid %u", policy->match.uid);
+
+    if (policy->deadline == 0)
+      seq_printf(m, " until released\n");
+    else if (choke_policy_active(policy, now))
+      seq_printf(m, " for %u ms\n", tm_ms_since(now, policy->deadline));
+    else
+      seq_printf(m, " expired\n");
+  }
+
+  rcu_read_unlock();
+  return 0;
+}
+
+static int choke_open(struct inode *inode, struct file *file)
+{
+  return single_open(file, choke_show, NULL);
+}
+
+static const struct file_operations choke_fops = {
+  .owner = THIS_MODULE,
+  .open = choke_open,
+  .read = seq_read,
+  .llseek = seq_lseek,
+  .release = single_release,
+};
+
+/*
+ * 'restore' is run from the choke timer, in softirq
+ * context.
+ */
+static void init_choke(struct dentry *parent, void (*restore)(void))
+{
+  choke_restore = restore;
+  setup_timer(&choke_timer, choke_timer_function, 0);
+  choke_file = debugfs_create_file("choke", 0444, parent, NULL, &choke_fops);
+}
+
+/*
+ * Called on module exit before the connections are
+ * freed. The netlink commands can not arm the timer
+ * again afterwards.
+ */
+static void stop_choke(void)
+{
+  spin_lock_bh(&choke_timer_lock);
+  choke_timer_stopped = true;
+  spin_unlock_bh(&choke_timer_lock);
+
+  del_timer_sync(&choke_timer);
+}
+
+/*
+ * Called on module exit, once neither the hooks nor
+ * the netlink commands can run.
+ */
+static void destroy_choke(void)
+{
+  debugfs_remove(choke_file);
+  choke_file = NULL;
+
+  replace_choke(NULL);
+  rcu_barrier();
+}
+
+#endif /* CHOKE_H_ */
@@ -0,0 +1,69 @@
+/* 
+ * This file is part of TrafficMonitor.
+ * 
+ * Copyright (C) 2011, Ahmad Nazir, Mohammad Hoque, Wei Li and Aki Saarinen.
+ * 
+ * TrafficMonitor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * TrafficMonitor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with TrafficMonitor.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef CLOCK_H_
+#define CLOCK_H_
+
+#include <linux/hrtimer.h>		// ktime_get()
+#include <linux/string.h>
+#include <linux/time.h>
+
+#include "events.h"
+
+/**
+ * Clock
+ *
+ * Every time in the module comes from the monotonic
+ * clock in nanoseconds. The hooks read it once per
+ * packet and hand it down to whatever needs it, the
+ * timers read it once when they fire. Timer deadlines
+ * and the reaper's aging stay in jiffies.
+ */
+static inline u64 tm_now(void)
+{
+  return ktime_to_ns(ktime_get());
+}
+
+/*
+ * Milliseconds between two clock readings, for the
+ * rate and idle time calculations.
+ */
+static inline u_int32_t tm_ms_since(u64 then, u64 now)
+{
+  return (u_int32_t) div_u64(now - then, NSEC_PER_MSEC);
+}
+
+/*
+ * Fill in a TM_EVENT_CLOCK record pairing the
+ * monotonic clock with the wall clock.
+ */
+static inline void fill_clock_event(struct tm_event *event)
+{
+  struct timespec ts;
+
+  memset(event, 0, sizeof(*event));
+  event->version = TM_EVENT_VERSION;
+  event->type = TM_EVENT_CLOCK;
+  event->timestamp = tm_now();
+  getnstimeofday(&ts);
+  event->wall_clock = timespec_to_ns(&ts);
+}
+
+#endif /* CLOCK_H_ */
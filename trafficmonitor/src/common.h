@@ -17,7 +17,143 @@
  * along with TrafficMonitor.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#define KERNEL_PACKET 1
-//#define ONLY_SHOW_SYN_ACK 1
-#define DISPLAY_BURST_STAGE 1
-#define OTHER_PACKET 1
+#ifndef COMMON_H_
+#define COMMON_H_
+
+#include <linux/version.h>
+#include <linux/moduleparam.h>
+#include <linux/mutex.h>
+
+/**
+ * Diagnostics
+ *
+ * The diagnostic output of the hooks is switched on
+ * and off at run time with module parameters, e.g.
+ * echo 1 > /sys/module/ec/parameters/display_burst_stage
+ *
+ *  display_burst_stage	log the packets that move a connection through the burst stages
+ *  other_packet		print a line for every packet that is not TCP
+ *  only_show_syn_ack	only log the packets of new and existing connections, do not track them
+ *  print_packet		print the connection id of every outgoing packet
+ *  hook_latency		time the hooks, see latency.h
+ *
+ * They used to be compile time defines. Every category
+ * is behind a static key, so a disabled category costs
+ * a no-op in the hooks that is patched into a jump when
+ * it is enabled. Kernels before 3.3 have no static keys;
+ * there a category is a read mostly flag tested with
+ * unlikely().
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 3, 0)
+
+#include <linux/jump_label.h>
+
+struct tm_diag {
+  struct static_key key;
+  bool enabled;
+};
+
+#define TM_DIAG_INIT { .key = STATIC_KEY_INIT_FALSE, .enabled = false }
+#define tm_diag_enabled(diag) static_key_false(&(diag)->key)
+
+static inline void tm_diag_switch(struct tm_diag *diag, bool on)
+{
+  if (on && !diag->enabled)
+    static_key_slow_inc(&diag->key);
+  else if (!on && diag->enabled)
+    static_key_slow_dec(&diag->key);
+  diag->enabled = on;
+}
+
+#else
+
+struct tm_diag {
+  bool enabled;
+};
+
+#define TM_DIAG_INIT { .enabled = false }
+#define tm_diag_enabled(diag) unlikely(ACCESS_ONCE((diag)->enabled))
+
+static inline void tm_diag_switch(struct tm_diag *diag, bool on)
+{
+  diag->enabled = on;
+}
+
+#endif
+
+static struct tm_diag diag_burst_stage __read_mostly = TM_DIAG_INIT;
+static struct tm_diag diag_other_packet __read_mostly = TM_DIAG_INIT;
+static struct tm_diag diag_only_show_syn_ack __read_mostly = TM_DIAG_INIT;
+static struct tm_diag diag_print_packet __read_mostly = TM_DIAG_INIT;
+static struct tm_diag diag_hook_latency __read_mostly = TM_DIAG_INIT;
+
+static DEFINE_MUTEX(diag_mutex);	// serializes switching the categories
+
+/*
+ * The module parameter callbacks got a const
+ * kernel_param in 2.6.36.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 36)
+#define TM_KERNEL_PARAM const struct kernel_param
+#else
+#define TM_KERNEL_PARAM struct kernel_param
+#endif
+
+static int set_diag(const char *val, TM_KERNEL_PARAM *kp)
+{
+  struct tm_diag *diag = kp->arg;
+  bool on;
+
+  if (val == NULL)
+    return -EINVAL;
+
+  switch (val[0]) {
+  case 'y': case 'Y': case '1':
+    on = true;
+    break;
+  case 'n': case 'N': case '0':
+    on = false;
+    break;
+  default:
+    return -EINVAL;
+  }
+
+  mutex_lock(&diag_mutex);
+  tm_diag_switch(diag, on);
+  mutex_unlock(&diag_mutex);
+  return 0;
+}
+
+static int get_diag(char *buffer, TM_KERNEL_PARAM *kp)
+{
+  struct tm_diag *diag = kp->arg;
+
+  return sprintf(buffer, "%c", diag->enabled ? 'Y' : 'N');
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 36)
+static struct kernel_param_ops diag_param_ops = {
+  .set = set_diag,
+  .get = get_diag,
+};
+#define diag_param(name, diag) module_param_cb(name, &diag_param_ops, diag, 0644)
+#else
+#define diag_param(name, diag) module_param_call(name, set_diag, get_diag, diag, 0644)
+#endif
+
+diag_param(display_burst_stage, &diag_burst_stage);
+MODULE_PARM_DESC(display_burst_stage, "Log the packets that move a connection through the burst stages");
+
+diag_param(other_packet, &diag_other_packet);
+MODULE_PARM_DESC(other_packet, "Print a line for every packet that is not TCP");
+
+diag_param(only_show_syn_ack, &diag_only_show_syn_ack);
+MODULE_PARM_DESC(only_show_syn_ack, "Only log the packets of new and existing connections, do not track them");
+
+diag_param(print_packet, &diag_print_packet);
+MODULE_PARM_DESC(print_packet, "Print the connection id of every outgoing packet");
+
+diag_param(hook_latency, &diag_hook_latency);
+MODULE_PARM_DESC(hook_latency, "Time the hooks into the latency histograms in debugfs");
+
+#endif /* COMMON_H_ */
@@ -21,8 +21,23 @@
 #define CONNECTIONS_H_
 
 #include <linux/ip.h>
+#include <linux/list.h>
+#include <linux/jhash.h>
+#include <linux/mempool.h>
+#include <linux/moduleparam.h>
+#include <linux/random.h>
+#include <linux/rcupdate.h>
+#include <linux/seqlock.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
 #include <net/tcp.h>
 
+#include "flowkey.h"
+#include "clock.h"
+#include "bursts.h"
+#include "packet.h"
+
 
 /**
  * Connection states
@@ -123,6 +138,20 @@
  */
 #define DEFAULT_MSS_VALUE		1452
 
+/*
+ * Where the TCP options of a connection are known from
+ */
+#define TM_OPTIONS_NONE			0	// not yet
+#define TM_OPTIONS_HANDSHAKE	1	// a SYN or SYN-ACK was seen
+#define TM_OPTIONS_SOCKET		2	// read from the socket, the connection was already open
+
+/*
+ * Owner of a connection whose socket has not been
+ * seen yet
+ */
+#define TM_UID_UNKNOWN			((uid_t) -1)
+#define TM_PID_UNKNOWN			0
+
 /*
  * PSM Throttling will not be enabled if the
  * ratio of the detected flow rate and the normal
@@ -275,106 +304,329 @@ static unsigned int total_sleep_time = 0;
 
 
 /**
- * Pointer to the head of list of all
- * connections. Whenever this struct is used, it
- * should be locked according to the function.
+ * Connection table
+ *
+ * All connections are kept in a hash table indexed
+ * by their flow key (see flowkey.h). The hooks hash
+ * the key of a packet once, with connection_hash(),
+ * and use that hash for both the lookup and the insert,
+ * so that they can find
+ * the connection of a packet in constant time no
+ * matter how many flows have been seen.
+ *
+ * The table starts with CONNECTION_HASH_INITIAL_SIZE
+ * buckets and is doubled whenever there are more than
+ * CONNECTION_HASH_MAX_LOAD connections per bucket on
+ * average.
+ *
+ * Locking:
+ *
+ * Readers (the hooks, the timers and the display
+ * functions) do not take any locks. They walk the
+ * buckets under rcu_read_lock(); the netfilter core
+ * already holds it while the hooks are running.
+ *
+ * Writers (adding, deleting and rehashing connections)
+ * are serialized with all_connections_spinlock, and
+ * deleted connections are freed with call_rcu() once
+ * no reader can be looking at them anymore.
+ * The timers of a connection are stopped with
+ * del_timer_sync() before it is handed to call_rcu(),
+ * so a timer never runs on a freed connection.
+ *
+ * Growing the table is done in a work item so that the
+ * new buckets can be allocated without GFP_ATOMIC. While
+ * the connections are moved, resize_seq is held for
+ * writing; a reader that missed a connection during that
+ * time looks it up again.
  */
-static struct constate *all_connections_head;
+#define CONNECTION_HASH_INITIAL_SIZE	64
+#define CONNECTION_HASH_MAX_SIZE		(1 << 16)
+#define CONNECTION_HASH_MAX_LOAD		2
+
+struct constate_hash {
+  unsigned int size;			/* number of buckets, always a power of two */
+  struct hlist_head buckets[0];
+};
+
+struct constate_table {
+  struct constate_hash *hash;	/* RCU protected */
+  unsigned int count;		/* number of connections in the table */
+  u_int32_t seed;			/* hash seed, randomized in init_connections() */
+  seqcount_t resize_seq;	/* bumped while the connections are rehashed */
+  struct work_struct resize_work;
+};
+
+static struct constate_table all_connections;
+
 /**
- * SpinLock for the Connection list
+ * Connection allocation
  *
- * This lock will be used when any change to the
- * structure of the list is required and not the
- * individual nodes i.e. when changing the 'next'
- * elemenent of a connection.For individual nodes,
- * each node carries it's own spinlock lock.
+ * Connections are allocated from their own slab caches
+ * (one for the hot and one for the cold part) through
+ * mempools, because add_connection() runs in
+ * the hooks, i.e. in atomic context. The allocation is
+ * done with GFP_ATOMIC and falls back to a reserve of
+ * connection_reserve preallocated connections when the
+ * slab can not give one right away, so a burst of new
+ * sockets does not stall the hooks.
  *
- * Initialized in the module init
+ * If both fail the packet is let through without a
+ * connection and connection_alloc_failures is bumped.
+ */
+static unsigned int connection_reserve = 64;
+module_param(connection_reserve, uint, 0444);
+MODULE_PARM_DESC(connection_reserve, "Number of preallocated connections kept in reserve");
+
+static struct kmem_cache *constate_cache;
+static struct kmem_cache *constate_cold_cache;
+static mempool_t *constate_pool;
+static mempool_t *constate_cold_pool;
+static atomic_t connection_alloc_failures = ATOMIC_INIT(0);
+
+/**
+ * Connection aging
  *
- * todo: Need to evaluate .. do we really want this?
+ * Connections are removed from the table by the
+ * reaper (see reap_connections()) once they have been
+ * closed with FIN or RST for fin_linger_ms, or have
+ * been idle for idle_timeout_ms (0 disables the idle
+ * timeout). The number of reaped connections is
+ * exported as read-only module parameters.
  */
-spinlock_t all_connections_spinlock;
+static unsigned int fin_linger_ms = 10000;
+module_param(fin_linger_ms, uint, 0644);
+MODULE_PARM_DESC(fin_linger_ms, "How long a connection is kept after FIN or RST (ms)");
 
+static unsigned int idle_timeout_ms = 600000;
+module_param(idle_timeout_ms, uint, 0644);
+MODULE_PARM_DESC(idle_timeout_ms, "How long an idle connection is kept, 0 keeps it forever (ms)");
 
+static unsigned int reap_interval_ms = 2000;
+module_param(reap_interval_ms, uint, 0644);
+MODULE_PARM_DESC(reap_interval_ms, "How often expired connections are looked for (ms)");
+
+static unsigned long reaped_closed_connections = 0;
+module_param(reaped_closed_connections, ulong, 0444);
+MODULE_PARM_DESC(reaped_closed_connections, "Number of connections freed after FIN or RST");
+
+static unsigned long reaped_idle_connections = 0;
+module_param(reaped_idle_connections, ulong, 0444);
+MODULE_PARM_DESC(reaped_idle_connections, "Number of connections freed after the idle timeout");
+
+static void reap_connections(struct work_struct *work);
+static DECLARE_DELAYED_WORK(reaper_work, reap_connections);
+
+/**
+ * RTT sampling
+ *
+ * The RTT of a connection is copied from its socket,
+ * which is only attached to the outgoing packets. The
+ * socket is read at most every rtt_interval_ms and
+ * never more than once per RTT, since its estimate
+ * does not change faster than that.
+ */
+static unsigned int rtt_interval_ms = 100;
+module_param(rtt_interval_ms, uint, 0644);
+MODULE_PARM_DESC(rtt_interval_ms, "Shortest time between two RTT samples of a connection (ms)");
+/**
+ * SpinLock for the Connection table
+ *
+ * This lock will be used when any change to the
+ * structure of the table is required and not the
+ * individual nodes i.e. when adding, removing or
+ * rehashing connections. Readers never take it,
+ * see the locking notes above.
+ *
+ * Defined initialized, as the reaper that takes it is
+ * scheduled by init_connections().
+ */
+DEFINE_SPINLOCK(all_connections_spinlock);
+
+
+
+/**
+ * Connection state
+ *
+ * The state of a connection is split in two parts:
+ *
+ * - struct constate holds what the hooks look at on
+ *   every packet. It is cache line aligned and the
+ *   fields compared while walking a bucket (hnode,
+ *   hash and key) come first, so that skipping over a
+ *   connection touches a single cache line.
+ *
+ * - struct constate_cold holds everything that is only
+ *   needed by the timers, the PSMT logic, the reaper
+ *   and the display functions. It is allocated
+ *   separately and reached through the 'cold' pointer.
+ */
+struct constate_cold;
 
 struct constate {
+
+  struct hlist_node hnode; /* link in the connection table bucket */
+
+  /*
+   * Hash of the flow key, the hash is kept so that
+   * the table can be grown without hashing the keys
+   * again and so that a bucket walk only needs to
+   * look at the key when the hash matches.
+   */
+  u_int32_t hash;
+
+  /*
+   * Flow key of the connection, only compared when
+   * the hash matches.
+   */
+  struct tm_flow_key key;
+
   /*
    * The connection id is always the port at the
    * client side. Since client must NOT take the
    * role of a server, hence this id will always
-   * be a big number i.e. > 1024 and is unique to
-   * the client (atleast for the time being i.e.
-   * tests can be conducted during this time)
+   * be a big number i.e. > 1024. It is only used
+   * for logging and in the events sent to the user
+   * space, the connection is identified by its key.
    *
    */
   u_int32_t connection_id;
 
+  /**
+   * State of the connection.
+   *
+   * Can be one of the above defined states i.e.
+   *  - TCP Handshake states such as SYN, SYN-ACK, ESTABLISHED
+   *  - Throttle Detection
+   *  - PSM Throttling
+   *  - Closed etc
+   *
+   *  Keep it 16 bit just in case we need extra states.
+   *
+   */
+  u_int16_t state;
+
+
+  u_int8_t burst_stage;
+
+  u_int8_t direction;  // To indicate direction of the traffic flow. 0 means this is a download flow, 1 means upload flow.
+
+  bool chocked;  // to indicate if the window has already been set to 0 (chocked)
+  u_int8_t closing;			// set once a FIN or RST has been seen
+  u_int8_t options_source;	// TM_OPTIONS_*, where the TCP options of the connection came from
+
   /*
-   * TCP Fields
+   * Owner of the local socket, learned from the
+   * outgoing packets. TM_UID_UNKNOWN until then. The
+   * process is only known from a packet sent in its
+   * own context, TM_PID_UNKNOWN until then. The
+   * filter reads them on every packet.
    */
-  u_int32_t src_port;
-  u_int32_t dst_port;
-  u_int16_t window_size;
-  u_int16_t previous_window_size;  // The place to store the window size before chocking
-  u_long ack_number;
-  u_long seq_number;
+  uid_t uid;
+  pid_t pid;
 
   /*
    * Receiving Window Scale
    */
   u_int16_t window_scale;
+  u_int16_t window_size;
+  u_int16_t previous_window_size;  // The window advertised before chocking, unscaled as on the wire
+
+  u64 timeStamp; // The time of current burst packet, monotonic clock in nanoseconds
+  u64 rtt_due;		// next time the RTT may be sampled, see sample_rtt()
+
+  // The time stamp of last valid burst packet, used in prediction.
+  //  u_int16_t previousTimeStamp;
 
-  
   /*
-   * Maximum Segment Size
-   *
-   * This value is cordinated during the TCP
-   * Handshake
+   * Aging, used by the connection reaper.
+   * In Jiffies
    */
-  u_int32_t tcpi_rcv_mss;
+  unsigned long last_seen;	// time of the last packet in either direction
+
+  u_int32_t data_arrived_td;		// in bytes, used during Throttle Detection
+  u_int32_t data_arrived_burst;	// in bytes, used to store total payload in a burst
+  u_int32_t temp_data_arrived;	// in bytes, used to store total bytes arrived (after buffer playout)
 
   /*
-   * IP Source and Destination Addresses
+   * Only data packets
+   *
+   * todo: explain when is the value refreshed.
+   *
    */
-  u_int32_t src_addr;
-  u_int32_t dst_addr;
+  u_int32_t packet_count_td;
+  u_int32_t total_packet_count;
 
   /*
-   * Round Trip Times
+   * Packets (segments on the wire) and TCP payload of
+   * the flow by direction, 0 uplink and 1 downlink as in
+   * the events. Counted for every packet of the
+   * connection, see count_connection_packet().
    */
-  u_int32_t srtt;		/* Smoothed Round Trip Time 	-	millisecs*/
-  u_int32_t rcv_rtt;	/* Receiver Side RTT Estimation -	millisecs*/
+  u_int32_t flow_packets[2];
+  u64 flow_bytes[2];
 
-  u_int32_t rtt;		/* Round Trip Time				-	nanosecs */
-  u_int32_t tcpi_rcv_rtt;		/* Round Trip Time 		-	nanosecs*/
-  u_int32_t rtt_var;		/* Round Trip Time 			-	nanosecs*/
+  struct constate_cold *cold; /* rarely used state, see below */
 
+} ____cacheline_aligned_in_smp;
 
-  /**
-   * State of the connection.
-   *
-   * Can be one of the above defined states i.e.
-   *  - TCP Handshake states such as SYN, SYN-ACK, ESTABLISHED
-   *  - Throttle Detection
-   *  - PSM Throttling
-   *  - Closed etc
-   *
-   *  Keep it 16 bit just in case we need extra states.
-   *
+/*
+ * The hot part takes 152 bytes on 32 bit, three 64 byte
+ * lines or five on the 32 byte lines of older ARM cores,
+ * and 168 bytes, three lines, on 64 bit. It can not be
+ * one line as the key alone is 40 bytes, but hnode, hash
+ * and key are in the first 64 bytes, so a bucket walk
+ * still touches one line per connection. Checked in
+ * create_constate_pools().
+ */
+#define TM_CONSTATE_HOT_BYTES (BITS_PER_LONG == 64 ? 192 : 160)
+
+struct constate_cold {
+
+  struct constate *node;	/* the hot part this belongs to */
+
+  unsigned long closed_at;	// time of the first FIN or RST, in jiffies
+
+  struct rcu_head rcu;     /* used to free the connection after a grace period */
+  struct constate* reap_next; /* private list of the connection reaper */
+
+  /*
+   * TCP Fields
    */
-  u_int16_t state;
+  u_int32_t src_port;
+  u_int32_t dst_port;
+  u_long ack_number;
+  u_long seq_number;
 
+  /*
+   * Maximum Segment Size
+   *
+   * This value is cordinated during the TCP
+   * Handshake
+   */
+  u_int32_t tcpi_rcv_mss;
 
-  int burst_stage;
+  /*
+   * TCP options announced by the phone and by the peer,
+   * see set_handshake_options(). window_scale and
+   * tcpi_rcv_mss are derived from them.
+   */
+  struct tm_tcp_options local_options;
+  struct tm_tcp_options peer_options;
 
-  int direction;  // To indicate direction of the traffic flow. 0 means this is a download flow, 1 means upload flow.
+  /*
+   * IP Source and Destination Addresses
+   */
+  u_int32_t src_addr;
+  u_int32_t dst_addr;
 
-  u_int32_t timeStamp; // The timestamp of current burst packet in microseconds
+  /*
+   * Round Trip Times, as in struct tcp_info
+   */
+  u_int32_t rtt;		/* Smoothed Round Trip Time		-	microsecs */
+  u_int32_t tcpi_rcv_rtt;		/* Receiver Side RTT Estimation	-	microsecs */
+  u_int32_t rtt_var;		/* Round Trip Time Variation	-	microsecs */
 
-  
-  // The time stamp of last valid burst packet, used in prediction.
-  //  u_int16_t previousTimeStamp;
-  
 
   /*
    * Choke State, defined above
@@ -385,8 +637,7 @@ struct constate {
    * - Post-Choke
    */
   u_int8_t choke_state;
-  bool chocked;  // to indicate if the window has already been set to 0 (chocked)
-  
+
 
   /*
    * PSMT state
@@ -426,25 +677,10 @@ struct constate {
   u_int32_t flow_rate_inst;		// During PSM Throttling, instantaneous
 
 
-  u_int32_t data_arrived_td;		// in bytes, used during Throttle Detection
-  u_int32_t data_arrived_burst;	// in bytes, used to store total payload in a burst
-  u_int32_t temp_data_arrived;	// in bytes, used to store total bytes arrived (after buffer playout)
-
-
   u_int32_t psmt_window_size;	// in bytes, packets expected to arrive, NOT scaled
   u_int32_t psmt_window_size_min;	// in bytes, packets expected to arrive, NOT scaled
 
 
-
-  /*
-   * Only data packets
-   *
-   * todo: explain when is the value refreshed.
-   *
-   */
-  u_int32_t packet_count_td;
-  u_int32_t total_packet_count;
-
   /*
    * Burst Time
    *
@@ -457,17 +693,18 @@ struct constate {
   u_int32_t burst_time;
 
   /*
-   * Connection start time in jiffies
+   * Connection start time, monotonic clock in
+   * nanoseconds (clock.h)
    *
    * Used to calculated flow_rate_normal
    * or flow rate when the connection is
    * established.
    */
-  u_int32_t connection_start_time;
+  u64 connection_start_time;
 
-  u_int32_t td_start_time;
+  u64 td_start_time;
 
-  u_int32_t psmt_start_time;
+  u64 psmt_start_time;
 
   /*
    * Total time for which the connection, in psmt
@@ -476,13 +713,13 @@ struct constate {
    * of time saved.
    * Only updated in the scheduler.
    *
-   * In Jiffies
+   * In milliseconds
    */
   u_int32_t psmt_time_lapsed;
 
   /*
    * Time for which connection has remained active.
-   * In Jiffies
+   * In milliseconds
    */
   u_int32_t connection_time_lapsed;
 
@@ -498,9 +735,9 @@ struct constate {
   /*
    * Temporary timestamp used to sum up idle periods
    * within the scheduler.
-   * In Jiffies.
+   * Monotonic clock in nanoseconds.
    */
-  u_int32_t sleep_timestamp;
+  u64 sleep_timestamp;
   unsigned long wake_timestamp; 	// set in the modify_sleep_timer() function
 									// The value is used by the scheduler to see
 									// when the connection will wake up.
@@ -553,437 +790,609 @@ struct constate {
 
   rwlock_t connection_rwlock; // readwrite lock
 
+  /*
+   * Burst being summed up when burst_summary is on
+   * (bursts.h). burst_lock is taken by the hooks and by
+   * the flush work, with the bottom halves disabled.
+   */
+  spinlock_t burst_lock;
+  struct tm_burst burst;
+
   /*
    * Test Fields.. can be removed
    */
   struct task_struct *task;
 
-  struct constate* next; /* pointer to the next connection */
-
 };
 
-static inline void add_connection(struct constate** arg_con,struct iphdr* arg_ip, struct tcphdr* arg_tcp, u_int32_t arg_con_id,u_int8_t state); /*Append a connection at the end of the list*/
-static inline void display_connections_info(struct constate** arg_con);
+static inline int init_connections(struct constate_table* table); /* Allocate the initial buckets */
+static inline struct constate * add_connection(struct constate_table* table, const struct tm_flow_key* key, u_int32_t hash, struct iphdr* arg_ip, struct tcphdr* arg_tcp, u_int8_t state); /* Insert a connection into the table */
+static inline void display_connections_info(struct constate_table* table);
 static inline char * get_current_state_name(u_int16_t state);
 static inline void timer_function(unsigned long data);
 static inline void sleep_timer_function(unsigned long data);
 static inline void wake_timer_function(unsigned long data);
-static inline struct constate * get_connection(struct constate** arg_con,u_int16_t arg_port_id);
+static inline struct constate * get_connection(struct constate_table* table, const struct tm_flow_key* key, u_int32_t hash);
 
-static inline void update_rtt(struct constate* node,struct sk_buff* conskb); // function that decides the method to fetch rtt
-static inline u_int8_t refresh_rtt(struct constate* node, struct sk_buff* conskb);
-static inline u_int8_t update_tcpi_rtt(struct constate* node, struct sk_buff* conskb); // obsolete
+static inline void count_connection_packet(struct constate* node, const struct tm_packet* packet, int incoming);
+static inline void sample_rtt(struct constate* node, struct sk_buff* conskb, u64 now);
 
-static inline u_int8_t update_tcpi_rcv_mss(struct constate* node, struct sk_buff* conskb);
-static inline void update_flow_rate_normal(struct constate* node);
-static inline void update_flow_rate_td(struct constate* node);
-static inline void update_flow_rate_psmt(struct constate* node);
+static inline void set_handshake_options(struct constate* node, struct sk_buff* conskb, const struct tm_packet* packet, int incoming);
+static inline void set_socket_options(struct constate* node, struct sk_buff* conskb);
+static inline void update_flow_rate_normal(struct constate* node, u64 now);
+static inline void update_flow_rate_td(struct constate* node, u64 now);
+static inline void update_flow_rate_psmt(struct constate* node, u64 now);
 static inline u_int32_t calculate_window_size(u_int32_t flowrate_normal , u_int32_t rtt);
 static inline void reduce_window_size(struct constate * connection);
 
-static inline void scheduler(struct constate * node, int idle_state, char * log_message);
+static inline void scheduler(struct constate * node, int idle_state, char * log_message, u64 now);
 
-static inline void delete_all(struct constate** arg_con); /* Delete all the connection*/
-static inline int delete_any(struct constate** arg_con, u_int16_t arg_port_id); /* Delete a specific connection from the poll*/
-static inline void dump_constate(struct constate** arg_con); /* Print all the connections */
-static inline int count(struct constate** arg_con); /* Delete all the connection*/
+static inline void delete_all(struct constate_table* table); /* Delete all the connection*/
+static inline int delete_any(struct constate_table* table, const struct tm_flow_key* key); /* Delete a specific connection from the poll*/
+static inline void dump_constate(struct constate_table* table); /* Print all the connections */
+static inline int count(struct constate_table* table); /* Count all the connections */
 
 #endif
 
 
 /**
- * Append a new connection at the end to the list of connections
- * - Initial version by Shathil
- *
- * Modifications made by Ahmad
- * - Separate connection id and source port
- * - State flags
- * - Timer
- * - Read Write SpinLocks
+ * Connection table helpers
  */
+#define connection_bucket(hash, key_hash) \
+  (&(hash)->buckets[(key_hash) & ((hash)->size - 1)])
 
-static inline void add_connection(struct constate** arg_con, struct iphdr* arg_ip, struct tcphdr* arg_tcp, u_int32_t arg_con_id, u_int8_t state) {
+static inline u_int32_t connection_hash(const struct constate_table* table, const struct tm_flow_key* key) {
+  return flow_key_hash(key, table->seed);
+}
 
-  struct constate *node, *temp = *arg_con;
-  if (*arg_con == NULL) {
-    temp = kmalloc(sizeof(struct constate), GFP_KERNEL);
+/*
+ * Iterate over every connection in the hash.
+ * 'bucket' and 'pos' are scratch variables. Must be
+ * called under rcu_read_lock() or with the
+ * all_connections_spinlock held.
+ */
+#define for_each_connection_rcu(hash, node, bucket, pos) \
+  for ((bucket) = 0; (bucket) < (hash)->size; (bucket)++) \
+    hlist_for_each_entry_rcu((node), (pos), &(hash)->buckets[(bucket)], hnode)
 
-    /**
-     * Initialize Read Write Spin Lock
-     */
-    rwlock_init( &temp->connection_rwlock);
+static inline struct constate_hash * alloc_connection_hash(unsigned int size) {
 
-    temp->connection_id = arg_con_id;
-    temp->src_port = ntohs(arg_tcp->source);
-    temp->dst_port = ntohs(arg_tcp->dest);
-    temp->window_size = ntohs(arg_tcp->window);
-    temp->previous_window_size = temp->window_size;
+  struct constate_hash *hash;
+  size_t bytes = sizeof(struct constate_hash) + size * sizeof(struct hlist_head);
+  unsigned int i;
 
-    temp->window_scale = 0;
-    temp->tcpi_rcv_mss = DEFAULT_MSS_VALUE;
+  if (bytes > PAGE_SIZE)
+    hash = vmalloc(bytes);
+  else
+    hash = kmalloc(bytes, GFP_KERNEL);
 
-    temp->seq_number = ntohs(arg_tcp->seq);
-    temp->ack_number = ntohs(arg_tcp->ack_seq);
+  if (hash == NULL)
+    return NULL;
 
-    temp->src_addr = ntohl(arg_ip->saddr);
-    temp->dst_addr = ntohl(arg_ip->daddr);
+  hash->size = size;
+  for (i = 0; i < size; i++)
+    INIT_HLIST_HEAD(&hash->buckets[i]);
 
-    temp->srtt = 0;
-    temp->rcv_rtt = 0;
-    temp->rtt = 0;
-    temp->tcpi_rcv_rtt = 0;
-    temp->rtt_var = 0;
+  return hash;
+}
 
+static inline void free_connection_hash(struct constate_hash *hash) {
 
-    temp->state = state;
-    temp->choke_state = NO_OP;
-    temp->psmt_state = NO_OP;
-    temp->idle_state = NOT_IDLE; // by default the connection is active
+  if (sizeof(struct constate_hash) + hash->size * sizeof(struct hlist_head) > PAGE_SIZE)
+    vfree(hash);
+  else
+    kfree(hash);
+}
 
-    temp->flow_rate_normal = 0;
-    temp->flow_rate_td = 0;
-    temp->flow_rate_psmt = 0;
-    temp->flow_rate_inst = 0;
+static inline struct constate * alloc_constate(void) {
 
-    temp->data_arrived_td = 0;
-    temp->data_arrived_burst = 0;
-    temp->temp_data_arrived = 0;
+  struct constate *node;
 
-    temp->psmt_window_size = 0;
-    temp->psmt_window_size_min = 0;
+  node = mempool_alloc(constate_pool, GFP_ATOMIC);
+  if (node == NULL)
+    return NULL;
 
-    temp->total_packet_count = 0;
-    temp->packet_count_td = 0;
+  node->cold = mempool_alloc(constate_cold_pool, GFP_ATOMIC);
+  if (node->cold == NULL) {
+    mempool_free(node, constate_pool);
+    return NULL;
+  }
+  node->cold->node = node;
 
-    temp->burst_time = 0;
-    temp->connection_start_time = 0;
-    temp->td_start_time = 0;
+  return node;
+}
 
-    temp->psmt_start_time = 0;
-    temp->psmt_time_lapsed = 0;
-    temp->connection_time_lapsed = 0;
+static inline void free_constate(struct constate *node) {
+  mempool_free(node->cold, constate_cold_pool);
+  mempool_free(node, constate_pool);
+}
 
-    temp->total_idle_time = 0;
-    temp->sleep_timestamp = 0;
+static void free_connection_rcu(struct rcu_head *head) {
+  free_constate(container_of(head, struct constate_cold, rcu)->node);
+}
 
-    temp->max_psmt_throughput = INITIAL_MAX_PSMT_THROUGHPUT;
-    temp->min_psmt_throughput = INITIAL_MIN_PSMT_THROUGHPUT;
+static inline void destroy_constate_pools(void) {
 
-    temp->next = NULL;
+  if (constate_cold_pool)
+    mempool_destroy(constate_cold_pool);
+  if (constate_pool)
+    mempool_destroy(constate_pool);
+  if (constate_cold_cache)
+    kmem_cache_destroy(constate_cold_cache);
+  if (constate_cache)
+    kmem_cache_destroy(constate_cache);
+}
 
-    /**
-     * Timer initialization
-     */
-    init_timer(&temp->timer);
-    temp->timer.data = (unsigned long) temp;
-    temp->timer.function = timer_function;
+static inline int create_constate_pools(void) {
 
-    init_timer(&temp->sleep_timer);
-    temp->sleep_timer.data = (unsigned long) temp;
-    temp->sleep_timer.function = sleep_timer_function;
+  BUILD_BUG_ON(sizeof(struct constate) >
+               L1_CACHE_BYTES * DIV_ROUND_UP(TM_CONSTATE_HOT_BYTES, L1_CACHE_BYTES));
 
-    init_timer(&temp->wake_timer);
-    temp->wake_timer.data = (unsigned long) temp;
-    temp->wake_timer.function = wake_timer_function;
+  constate_cache = kmem_cache_create("tm_constate", sizeof(struct constate), 0,
+                                     SLAB_HWCACHE_ALIGN, NULL);
+  constate_cold_cache = kmem_cache_create("tm_constate_cold", sizeof(struct constate_cold), 0,
+                                          0, NULL);
+  if (constate_cache == NULL || constate_cold_cache == NULL)
+    goto fail;
 
-    // change for testing
-    temp->task = NULL;
-    // end
+  constate_pool = mempool_create_slab_pool(connection_reserve, constate_cache);
+  constate_cold_pool = mempool_create_slab_pool(connection_reserve, constate_cold_cache);
+  if (constate_pool == NULL || constate_cold_pool == NULL)
+    goto fail;
 
-    *arg_con = temp;
+  return 0;
 
-  } else {
-    while (temp->next != NULL)
-      temp = temp->next;
+ fail:
+  destroy_constate_pools();
+  return -ENOMEM;
+}
 
-    node = kmalloc(sizeof(struct constate), GFP_KERNEL);
-    /**
-     * Initialize Read Write Spin Lock
-     */
-    rwlock_init(&node->connection_rwlock);
+/*
+ * Double the number of buckets and rehash all the
+ * connections into the new buckets.
+ *
+ * Runs from the resize work item, scheduled by
+ * add_connection(). If there is no memory the table
+ * simply keeps its current size and the chains get a
+ * bit longer.
+ *
+ * The work item can run on two CPUs at once, as it is
+ * scheduled again on every insert while the table is
+ * over its limit. The run that finds the table already
+ * grown under the lock drops its buckets.
+ */
+static void grow_connections(struct work_struct *work) {
+
+  struct constate_table *table = container_of(work, struct constate_table, resize_work);
+  struct constate_hash *hash, *old_hash;
+  unsigned int i;
+  struct constate *node;
+  struct hlist_node *pos, *tmp;
+  unsigned int size;
+
+  rcu_read_lock();
+  old_hash = rcu_dereference(table->hash);
+  size = old_hash->size;
+  rcu_read_unlock();
+
+  if (size * 2 > CONNECTION_HASH_MAX_SIZE)
+    return;
+
+  hash = alloc_connection_hash(size * 2);
+  if (hash == NULL)
+    return;
+
+  spin_lock_bh(&all_connections_spinlock);
+  if (table->hash != old_hash) {
+    spin_unlock_bh(&all_connections_spinlock);
+    free_connection_hash(hash);
+    return;
+  }
 
-    node->connection_id = arg_con_id;
-    node->src_port = ntohs(arg_tcp->source);
-    node->dst_port = ntohs(arg_tcp->dest);
-    node->window_size = ntohs(arg_tcp->window);
+  write_seqcount_begin(&table->resize_seq);
 
-    node->window_scale = 0;
-    node->tcpi_rcv_mss = DEFAULT_MSS_VALUE;
+  for (i = 0; i < old_hash->size; i++) {
+    hlist_for_each_entry_safe(node, pos, tmp, &old_hash->buckets[i], hnode) {
+      hlist_del_rcu(&node->hnode);
+      hlist_add_head_rcu(&node->hnode, connection_bucket(hash, node->hash));
+    }
+  }
+  rcu_assign_pointer(table->hash, hash);
 
-    node->seq_number = ntohs(arg_tcp->seq);
-    node->ack_number = ntohs(arg_tcp->ack_seq);
+  write_seqcount_end(&table->resize_seq);
+  spin_unlock_bh(&all_connections_spinlock);
 
-    node->src_addr = ntohl(arg_ip->saddr);
-    node->dst_addr = ntohl(arg_ip->daddr);
+  /*
+   * Wait until no reader can be walking the old
+   * buckets anymore
+   */
+  synchronize_rcu();
+  free_connection_hash(old_hash);
+}
 
-    node->srtt = 0;
-    node->rcv_rtt = 0;
+/**
+ * Initialize the connection table
+ *
+ * Called once from the module init, returns
+ * -ENOMEM if the buckets or the connection
+ * reserve can not be allocated.
+ */
+static inline int init_connections(struct constate_table* table) {
 
-    node->burst_stage = BURST_NO_CONNECTION;
-    
-    node->rtt = 0;
-    node->tcpi_rcv_rtt = 0;
-    node->rtt_var = 0;
+  if (create_constate_pools() != 0)
+    return -ENOMEM;
 
-    node->state = state;
-    node->choke_state = NO_OP;
-    node->psmt_state = NO_OP;
-    node->idle_state = NOT_IDLE; // by default the connection is active
+  table->hash = alloc_connection_hash(CONNECTION_HASH_INITIAL_SIZE);
+  if (table->hash == NULL) {
+    destroy_constate_pools();
+    return -ENOMEM;
+  }
 
-    node->flow_rate_normal = 0;
-    node->flow_rate_td = 0;
-    node->flow_rate_psmt = 0;
-    node->flow_rate_inst = 0;
+  table->count = 0;
+  get_random_bytes(&table->seed, sizeof(table->seed));
+  seqcount_init(&table->resize_seq);
+  INIT_WORK(&table->resize_work, grow_connections);
 
-    node->data_arrived_td = 0;
-    node->data_arrived_burst = 0;
-    node->temp_data_arrived = 0;
+  schedule_delayed_work(&reaper_work, msecs_to_jiffies(reap_interval_ms));
 
-    node->psmt_window_size = 0;
-    node->psmt_window_size_min = 0;
+  return 0;
+}
 
-    node->total_packet_count = 0;
-    node->packet_count_td = 0;
+/*
+ * Lookup without retrying, used by writers holding
+ * the all_connections_spinlock and by get_connection().
+ */
+static inline struct constate * __get_connection(struct constate_table* table,
+                                                 const struct tm_flow_key* key, u_int32_t key_hash) {
 
-    node->burst_time = 0;
-    node->connection_start_time = 0;
-    node->td_start_time = 0;
-    node->psmt_start_time = 0;
-    node->psmt_time_lapsed = 0;
-    node->connection_time_lapsed = 0;
+  struct constate_hash *hash = rcu_dereference(table->hash);
+  struct constate *node;
+  struct hlist_node *pos;
 
+  hlist_for_each_entry_rcu(node, pos, connection_bucket(hash, key_hash), hnode) {
+    if (node->hash == key_hash && flow_key_equal(&node->key, key)) {
+      return node;
+    }
+  }
 
-    node->chocked = false;
-    
+  return NULL;
+}
 
-    node->total_idle_time = 0;
-    node->sleep_timestamp = 0;
+/**
+ * Insert a new connection into the connection table
+ * - Initial version by Shathil
+ *
+ * Modifications made by Ahmad
+ * - Separate connection id and source port
+ * - State flags
+ * - Timer
+ * - Read Write SpinLocks
+ *
+ * Returns the new connection, or NULL if it could
+ * not be allocated. If another CPU added the same
+ * connection in the meantime, that one is returned.
+ */
 
-    node->max_psmt_throughput = INITIAL_MAX_PSMT_THROUGHPUT;
-    node->min_psmt_throughput = INITIAL_MIN_PSMT_THROUGHPUT;
+static inline struct constate * add_connection(struct constate_table* table, const struct tm_flow_key* key, u_int32_t hash, struct iphdr* arg_ip, struct tcphdr* arg_tcp, u_int8_t state) {
 
-    node->next = NULL;
+  struct constate *node, *existing;
 
-    /*
-     * Timer Initialization
-     */
-    init_timer(&node->timer);
-    node->timer.data = (unsigned long) node;
-    node->timer.function = timer_function;
+  node = alloc_constate();
+  if (node == NULL) {
+    atomic_inc(&connection_alloc_failures);
+    return NULL;
+  }
 
-    init_timer(&node->sleep_timer);
-    node->sleep_timer.data = (unsigned long) node;
-    node->sleep_timer.function = sleep_timer_function;
+  /**
+   * Initialize Read Write Spin Lock
+   */
+  rwlock_init(&node->cold->connection_rwlock);
 
-    init_timer(&node->wake_timer);
-    node->wake_timer.data = (unsigned long) node;
-    node->wake_timer.function = wake_timer_function;
+  node->key = *key;
+  node->hash = hash;
+  node->connection_id = ntohs(key->local_port);
+  node->cold->src_port = ntohs(arg_tcp->source);
+  node->cold->dst_port = ntohs(arg_tcp->dest);
+  node->window_size = ntohs(arg_tcp->window);
+  node->previous_window_size = node->window_size;
 
-    // change for testing
-    node->task = NULL;
-    // end
+  node->window_scale = 0;
+  node->cold->tcpi_rcv_mss = DEFAULT_MSS_VALUE;
+  memset(&node->cold->local_options, 0, sizeof(struct tm_tcp_options));
+  memset(&node->cold->peer_options, 0, sizeof(struct tm_tcp_options));
+  node->options_source = TM_OPTIONS_NONE;
 
+  node->cold->seq_number = ntohs(arg_tcp->seq);
+  node->cold->ack_number = ntohs(arg_tcp->ack_seq);
 
-    temp->next = node;
+  node->cold->src_addr = ntohl(arg_ip->saddr);
+  node->cold->dst_addr = ntohl(arg_ip->daddr);
 
-  }
-}
 
-/**
- * Get Connection
- *
- * -Ahmad
- */
-static inline struct constate * get_connection(struct constate** arg_con,
-                                               u_int16_t connection_id) {
+  node->burst_stage = BURST_NO_CONNECTION;
+  node->direction = 0;
+  node->timeStamp = 0;
 
-  struct constate *node = *arg_con;
+  node->last_seen = jiffies;
+  node->cold->closed_at = 0;
+  node->closing = 0;
+  node->uid = TM_UID_UNKNOWN;
+  node->pid = TM_PID_UNKNOWN;
+  node->rtt_due = 0;
 
-  while (node != NULL) {
-    if (node->connection_id == connection_id) {
-      //			printk(" 2 - in function   : %d\n", node->connection_id);
-      return node;
-    }
-    node = node->next;
-  }
+  node->cold->rtt = 0;
+  node->cold->tcpi_rcv_rtt = 0;
+  node->cold->rtt_var = 0;
 
-  return NULL;
-}
+  node->state = state;
+  node->cold->choke_state = NO_OP;
+  node->cold->psmt_state = NO_OP;
+  node->cold->idle_state = NOT_IDLE; // by default the connection is active
 
-/**
- * Set a connection's state
- *
- * Find the node from the connection id and set the state
- *
- * -Ahmad
- */
-static inline u_int8_t set_connection_state(struct constate** arg_con,
-                                            u_int16_t arg_port_id, u_int16_t state) {
-  struct constate *temp = *arg_con;
-  while (temp != NULL) {
-
-    if (temp->connection_id == arg_port_id) {
-      temp->state = state;
-      return 0;
-    }
+  node->cold->flow_rate_normal = 0;
+  node->cold->flow_rate_td = 0;
+  node->cold->flow_rate_psmt = 0;
+  node->cold->flow_rate_inst = 0;
 
-    temp = temp->next;
-  }//end of while
+  node->data_arrived_td = 0;
+  node->data_arrived_burst = 0;
+  node->temp_data_arrived = 0;
 
-  return -1;
-}
+  node->cold->psmt_window_size = 0;
+  node->cold->psmt_window_size_min = 0;
+
+  node->total_packet_count = 0;
+  node->packet_count_td = 0;
+  memset(node->flow_packets, 0, sizeof(node->flow_packets));
+  memset(node->flow_bytes, 0, sizeof(node->flow_bytes));
 
+  node->cold->burst_time = 0;
+  node->cold->connection_start_time = 0;
+  node->cold->td_start_time = 0;
+  node->cold->psmt_start_time = 0;
+  node->cold->psmt_time_lapsed = 0;
+  node->cold->connection_time_lapsed = 0;
 
-static inline void update_rtt(struct constate* node,
-                              struct sk_buff* conskb){
 
+  node->chocked = false;
 
-  if (node != NULL && conskb != NULL) {
-    //refresh_rtt(connection, my_skb);	// If we have to use this function,
-    // the time units need to be adjusted
-    // from millisecs to nanosecs
 
-    update_tcpi_rtt(node, conskb);
+  node->cold->total_idle_time = 0;
+  node->cold->sleep_timestamp = 0;
+
+  spin_lock_init(&node->cold->burst_lock);
+  init_burst(&node->cold->burst);
+
+  node->cold->max_psmt_throughput = INITIAL_MAX_PSMT_THROUGHPUT;
+  node->cold->min_psmt_throughput = INITIAL_MIN_PSMT_THROUGHPUT;
+
+  /*
+   * Timer Initialization
+   */
+  init_timer(&node->cold->timer);
+  node->cold->timer.data = (unsigned long) node;
+  node->cold->timer.function = timer_function;
+
+  init_timer(&node->cold->sleep_timer);
+  node->cold->sleep_timer.data = (unsigned long) node;
+  node->cold->sleep_timer.function = sleep_timer_function;
+
+  init_timer(&node->cold->wake_timer);
+  node->cold->wake_timer.data = (unsigned long) node;
+  node->cold->wake_timer.function = wake_timer_function;
+
+  // change for testing
+  node->cold->task = NULL;
+  // end
+
+  spin_lock_bh(&all_connections_spinlock);
+
+  existing = __get_connection(table, key, hash);
+  if (existing != NULL) {
+    spin_unlock_bh(&all_connections_spinlock);
+    free_constate(node);
+    return existing;
   }
 
-}
+  hlist_add_head_rcu(&node->hnode, connection_bucket(table->hash, hash));
+  table->count++;
+  tm_stat_inc(TM_STAT_CONNECTIONS_CREATED);
 
+  if (table->count > table->hash->size * CONNECTION_HASH_MAX_LOAD)
+    schedule_work(&table->resize_work);
 
+  spin_unlock_bh(&all_connections_spinlock);
+
+  return node;
+}
 
 /**
- * Update RTT of a connection
+ * Get Connection
+ *
+ * Lockless, must be called under rcu_read_lock().
+ * The returned connection stays valid until
+ * rcu_read_unlock().
+ *
  * -Ahmad
  */
-static inline u_int8_t refresh_rtt(struct constate* node,
-                                   struct sk_buff* conskb) {
+static inline struct constate * get_connection(struct constate_table* table,
+                                               const struct tm_flow_key* key, u_int32_t hash) {
+
+  struct constate *node;
+  unsigned int seq;
 
-  struct tcp_sock* tp = tcp_sk(conskb->sk);
+  do {
+    seq = read_seqcount_begin(&table->resize_seq);
+    node = __get_connection(table, key, hash);
+  } while (node == NULL && read_seqcount_retry(&table->resize_seq, seq));
 
-  if (tp) {
+  tm_stat_inc(TM_STAT_LOOKUPS);
+  if (node == NULL)
+    tm_stat_inc(TM_STAT_LOOKUP_MISSES);
 
-    node->srtt = tp->srtt;
-    node->rcv_rtt = tp->rcv_rtt_est.rtt;
-    return 0;
+  return node;
+}
+
+/**
+ * Set a connection's state
+ *
+ * Find the node from the flow key and set the state
+ *
+ * -Ahmad
+ */
+static inline u_int8_t set_connection_state(struct constate_table* table,
+                                            const struct tm_flow_key* key, u_int16_t state) {
+  struct constate *temp;
+  u_int8_t ret = -1;
+
+  rcu_read_lock();
+  temp = get_connection(table, key, connection_hash(table, key));
+  if (temp != NULL) {
+    temp->state = state;
+    ret = 0;
   }
+  rcu_read_unlock();
 
-  return -1;
+  return ret;
 }
 
 
 /*
- * Get RTT from tcp_info structure
+ * Remember when a connection was first seen closing,
+ * the reaper frees it fin_linger_ms later.
  */
-static inline u_int8_t update_tcpi_rtt(struct constate* node,
-                                       struct sk_buff* conskb) {
+static inline void mark_connection_closing(struct constate* node) {
 
-  struct tcp_info temp_tcp_info;
-  struct sock * sk;
-
-  if (node == NULL || conskb == NULL){
-    return -1;
+  if (!node->closing) {
+    node->cold->closed_at = jiffies;
+    node->closing = 1;
   }
+}
 
+/*
+ * Add a packet to the counters of its connection. The
+ * counters are not locked, two CPUs adding at the same
+ * time may lose a packet.
+ */
+static inline void count_connection_packet(struct constate* node, const struct tm_packet* packet,
+                                           int incoming) {
 
-  sk = conskb->sk;
+  node->flow_packets[incoming] += packet->segments;
+  node->flow_bytes[incoming] += packet->payload;
+}
 
-  if (sk != NULL ){
+/*
+ * Copy the RTT estimate of the socket into the
+ * connection, rate limited as described above. The
+ * fields are read without the socket lock, as
+ * tcp_get_info() does, and converted the same way.
+ */
+static inline void sample_rtt(struct constate* node,
+                              struct sk_buff* conskb, u64 now) {
 
-    tcp_get_info(sk, &temp_tcp_info);
+  struct sock *sk = conskb->sk;
+  const struct tcp_sock *tp;
+  u_int32_t period;
 
-    if (&temp_tcp_info != NULL){
-      node->rtt = temp_tcp_info.tcpi_rtt;
-      node->tcpi_rcv_rtt = temp_tcp_info.tcpi_rcv_rtt;
-      node->rtt_var = temp_tcp_info.tcpi_rttvar;
-    }
+  if (now < node->rtt_due)
+    return;
 
-  }
+  // replies sent by the kernel go through its raw control socket
+  if (sk == NULL || sk->sk_type != SOCK_STREAM || sk->sk_protocol != IPPROTO_TCP)
+    return;
 
-  return -1;
+  tp = tcp_sk(sk);
+  node->cold->rtt = jiffies_to_usecs(tp->srtt) >> 3;
+  node->cold->rtt_var = jiffies_to_usecs(tp->mdev) >> 2;
+  node->cold->tcpi_rcv_rtt = jiffies_to_usecs(tp->rcv_rtt_est.rtt) >> 3;
+
+  period = max_t(u_int32_t, rtt_interval_ms * USEC_PER_MSEC, node->cold->rtt);
+  node->rtt_due = now + (u64) period * NSEC_PER_USEC;
 }
 
 
 
-/*
- * Get Window Scale Value
+/**
+ * TCP options of a connection
+ *
+ * The window scale the phone uses for its receive
+ * window, needed to rewrite the window, and the MSS of
+ * the segments it receives, used to size the PSMT
+ * window. Both are taken from the options of the
+ * handshake. Window scaling is only in use if both
+ * sides announced it. The segments the phone receives
+ * are bounded by the MSS the phone itself announced,
+ * not by the one of the peer.
  */
-static inline u_int8_t update_window_scale_value(struct constate* node,
-                                                 struct sk_buff* conskb) {
-
-  struct tcp_info temp_tcp_info;
-  struct sock * sk;
+static inline void apply_tcp_options(struct constate* node) {
 
-  if (node == NULL || conskb == NULL){
-    return -1;
-  }
+  struct tm_tcp_options *local = &node->cold->local_options;
+  struct tm_tcp_options *peer = &node->cold->peer_options;
 
+  if (local->flags & peer->flags & TM_TCPOPT_WSCALE)
+    node->window_scale = local->wscale;
+  else
+    node->window_scale = 0;
 
-  sk = conskb->sk;
-
-  if (sk != NULL ){
-    /*
-     * I know this might be a very very very basic
-     * question.. but when I declare a pointer to
-     * tcp_info as:
-     *
-     * struct tcp_info * temp_tcp_info;
-     *
-     * and give the argument as 'temp_tcp_info'
-     * instead of '&temp_tcp_info' as it is in
-     * the current case, the following function
-     * crashes..
-     *
-     * isn't it the same thing ?? I know
-     * this is stupid...
-     *
-     */
-    tcp_get_info(sk, &temp_tcp_info);
-
-    if (&temp_tcp_info != NULL){
-      node->window_scale = temp_tcp_info.tcpi_rcv_wscale;
-    }
+  if (local->flags & TM_TCPOPT_MSS)
+    node->cold->tcpi_rcv_mss = local->mss;
+  else
+    node->cold->tcpi_rcv_mss = DEFAULT_MSS_VALUE;
+}
 
-  }
+static inline bool connection_sack_ok(struct constate* node) {
+  return node->cold->local_options.flags & node->cold->peer_options.flags & TM_TCPOPT_SACK_PERM;
+}
 
-  return -1;
+static inline bool connection_timestamps_ok(struct constate* node) {
+  return node->cold->local_options.flags & node->cold->peer_options.flags & TM_TCPOPT_TIMESTAMP;
 }
 
 /*
- * Get MSS from tcp_info structure
+ * Take the options of a SYN or SYN-ACK, 'incoming'
+ * tells whether the peer or the phone sent it.
  */
-static inline u_int8_t update_tcpi_rcv_mss(struct constate* node,
-                                           struct sk_buff* conskb) {
-
-  struct tcp_info temp_tcp_info;
-  struct sock * sk;
+static inline void set_handshake_options(struct constate* node, struct sk_buff* conskb,
+                                         const struct tm_packet* packet, int incoming) {
 
-  if (node == NULL || conskb == NULL){
-    return -1;
-  }
+  parse_tcp_options(conskb, packet,
+                    incoming ? &node->cold->peer_options : &node->cold->local_options);
+  node->options_source = TM_OPTIONS_HANDSHAKE;
+  apply_tcp_options(node);
+}
 
+/*
+ * For a connection whose handshake was not seen, read
+ * what was agreed from the socket, once. Only outgoing
+ * packets carry the socket.
+ */
+static inline void set_socket_options(struct constate* node, struct sk_buff* conskb) {
 
-  sk = conskb->sk;
+  struct sock *sk = conskb->sk;
+  const struct tcp_sock *tp;
+  u_int8_t flags = 0;
 
-  if (sk != NULL ){
+  if (sk == NULL || sk->sk_type != SOCK_STREAM || sk->sk_protocol != IPPROTO_TCP)
+    return;
 
-    tcp_get_info(sk, &temp_tcp_info);
+  tp = tcp_sk(sk);
 
-    if (&temp_tcp_info != NULL){
+  if (tp->rx_opt.wscale_ok)
+    flags |= TM_TCPOPT_WSCALE;
+  if (tp->rx_opt.sack_ok)
+    flags |= TM_TCPOPT_SACK_PERM;
+  if (tp->rx_opt.tstamp_ok)
+    flags |= TM_TCPOPT_TIMESTAMP;
 
-      /*
-       * todo:
-       *
-       * This function is not working properly.
-       * For now the default value of MSS is
-       * returned i.e. DEFAULT_MSS_VALUE .. 1452
-       */
-      node->tcpi_rcv_mss = DEFAULT_MSS_VALUE;
-      //			node->tcpi_rcv_mss = temp_tcp_info.tcpi_advmss;
+  node->cold->local_options.wscale = tp->rx_opt.rcv_wscale;
+  node->cold->local_options.mss = tp->advmss;
+  node->cold->local_options.flags = flags | TM_TCPOPT_MSS;
+  node->cold->peer_options.wscale = tp->rx_opt.snd_wscale;
+  node->cold->peer_options.mss = tp->rx_opt.mss_clamp;
+  node->cold->peer_options.flags = flags | TM_TCPOPT_MSS;
 
-    }
-
-  }
-
-  return -1;
+  node->options_source = TM_OPTIONS_SOCKET;
+  apply_tcp_options(node);
 }
 
 /*
@@ -1036,60 +1445,185 @@ static inline char * get_psmt_state_name(u_int8_t psmt_state) {
   return "Error";
 }
 
-/* To delete  a specific connection*/
-static inline int delete_any(struct constate** arg_con, u_int16_t arg_port_id) {
+/*
+ * Stop the timers of a connection that has been
+ * unlinked from the table and free it once all
+ * readers are done with it.
+ *
+ * Must not be called from the connection's own timers.
+ */
+static inline void release_connection(struct constate* node) {
 
-  struct constate *old, *temp = *arg_con;
+  del_timer_sync(&node->cold->timer);
+  del_timer_sync(&node->cold->sleep_timer);
+  del_timer_sync(&node->cold->wake_timer);
+  call_rcu(&node->cold->rcu, free_connection_rcu);
+}
 
-  while (temp != NULL) {
-    if (temp->connection_id == arg_port_id) {
-      /* If it is the beginner node */
+/* To delete  a specific connection*/
+static inline int delete_any(struct constate_table* table, const struct tm_flow_key* key) {
 
-      if (temp == *arg_con) {
-        *arg_con = temp->next;
-        kfree(temp);
-        printk(KERN_INFO"%s is called.....Connection %u is deleted....\n", __FUNCTION__,temp->connection_id);
-        return 1;
-      } else {
-        old->next = temp->next;
-        kfree(temp);
-        printk(KERN_INFO"%s is called.....Connection %u is deleted....\n", __FUNCTION__,temp->connection_id);
-        return 1;
-      }//end of inner if/else
-    } else {
-      old = temp;
-      temp = temp->next;
-    }//end of outer if/else
-  }//end of while loop
+  struct constate *temp;
+
+  spin_lock_bh(&all_connections_spinlock);
+  temp = __get_connection(table, key, connection_hash(table, key));
+  if (temp != NULL) {
+    hlist_del_rcu(&temp->hnode);
+    table->count--;
+  }
+  spin_unlock_bh(&all_connections_spinlock);
 
+  if (temp != NULL) {
+    printk(KERN_INFO"%s is called.....Connection %u is deleted....\n", __FUNCTION__,temp->connection_id);
+    release_connection(temp);
+    return 1;
+  }
 
   /* If the specified connection is not found */
-  printk(KERN_INFO"%s: Port %d Connection is not Found....\n", __FUNCTION__,arg_port_id);
+  printk(KERN_INFO"%s: Port %d Connection is not Found....\n", __FUNCTION__,ntohs(key->local_port));
+  return 0;
+}
+
+/*
+ * Has the connection expired, i.e. has it been closed
+ * for longer than the linger time or been idle for
+ * longer than the idle timeout?
+ */
+static inline int connection_expired(struct constate* node, unsigned long now) {
+
+  if (node->closing && time_after(now, node->cold->closed_at + msecs_to_jiffies(fin_linger_ms)))
+    return CLOSED;
+
+  if (idle_timeout_ms && time_after(now, node->last_seen + msecs_to_jiffies(idle_timeout_ms)))
+    return IDLE;
+
   return 0;
 }
 
-static inline void delete_all(struct constate** arg_con) {
+/**
+ * Connection Reaper
+ *
+ * Runs every reap_interval_ms from a single delayed
+ * work item and frees the connections that have been
+ * closed with FIN or RST more than fin_linger_ms ago,
+ * or have not seen any packets for idle_timeout_ms.
+ *
+ * The table is swept one bucket at a time so that the
+ * writer lock is never held for long. Expired
+ * connections are unlinked under the lock and released
+ * after it has been dropped, since stopping their
+ * timers may have to wait.
+ */
+static void reap_connections(struct work_struct *work) {
+
+  struct constate_table *table = &all_connections;
+  struct constate_hash *hash;
+  struct constate *node, *reaped = NULL;
+  struct hlist_node *pos, *tmp;
+  unsigned long now = jiffies;
+  unsigned int bucket;
+  int reason;
+
+  for (bucket = 0; ; bucket++) {
+
+    spin_lock_bh(&all_connections_spinlock);
+
+    /*
+     * The table may have been grown since the last
+     * bucket, in which case some connections will be
+     * looked at on the next run
+     */
+    hash = table->hash;
+    if (bucket >= hash->size) {
+      spin_unlock_bh(&all_connections_spinlock);
+      break;
+    }
+
+    hlist_for_each_entry_safe(node, pos, tmp, &hash->buckets[bucket], hnode) {
+      reason = connection_expired(node, now);
+      if (reason == 0)
+        continue;
+
+      hlist_del_rcu(&node->hnode);
+      table->count--;
+      tm_stat_inc(TM_STAT_CONNECTIONS_REAPED);
 
-  struct constate* node, *temp = *arg_con;
-  while (temp != NULL) {
-    node = temp;
-    del_timer(&node->timer);
-    del_timer(&node->sleep_timer);
-    temp = temp->next;
-    kfree(node);
+      if (reason == CLOSED)
+        reaped_closed_connections++;
+      else
+        reaped_idle_connections++;
+
+      node->cold->reap_next = reaped;
+      reaped = node;
+    }
+
+    spin_unlock_bh(&all_connections_spinlock);
   }
 
-  printk(KERN_INFO"Function '%s' is called, all connections are deleted\n", __FUNCTION__);
+  while (reaped != NULL) {
+    node = reaped;
+    reaped = node->cold->reap_next;
+    release_connection(node);
+  }
 
+  schedule_delayed_work(&reaper_work, msecs_to_jiffies(reap_interval_ms));
 }
 
-static inline void dump_constate(struct constate** arg_con) /* Print all the connections */
+/*
+ * Called on module exit, after the hooks have been
+ * unregistered, so there are no readers left apart
+ * from the connection timers.
+ */
+static inline void delete_all(struct constate_table* table) {
+
+  struct constate *node;
+  struct hlist_node *pos, *tmp;
+  unsigned int bucket;
+
+  cancel_delayed_work_sync(&reaper_work);
+  cancel_work_sync(&table->resize_work);
+
+  for (bucket = 0; bucket < table->hash->size; bucket++) {
+    hlist_for_each_entry_safe(node, pos, tmp, &table->hash->buckets[bucket], hnode) {
+      del_timer_sync(&node->cold->timer);
+      del_timer_sync(&node->cold->sleep_timer);
+      del_timer_sync(&node->cold->wake_timer);
+      hlist_del(&node->hnode);
+      free_constate(node);
+    }
+  }
+
+  /*
+   * Wait for connections deleted earlier with
+   * call_rcu() before the module goes away
+   */
+  rcu_barrier();
+
+  table->count = 0;
+  free_connection_hash(table->hash);
+  table->hash = NULL;
+
+  destroy_constate_pools();
+
+  printk(KERN_INFO"Function '%s' is called, all connections are deleted (%d allocation failures, %lu closed and %lu idle connections reaped)\n",
+         __FUNCTION__, atomic_read(&connection_alloc_failures),
+         reaped_closed_connections, reaped_idle_connections);
+
+}
+
+static inline void dump_constate(struct constate_table* table) /* Print all the connections */
 {
-  struct constate *temp = *arg_con;
-  while (temp != NULL) {
+  struct constate_hash *hash;
+  struct constate *temp;
+  struct hlist_node *pos;
+  unsigned int bucket;
+
+  rcu_read_lock();
+  hash = rcu_dereference(table->hash);
+  for_each_connection_rcu(hash, temp, bucket, pos) {
     printk(KERN_INFO" Connection id %d \n", temp->connection_id);
-    temp = temp->next;
   }
+  rcu_read_unlock();
 }
 
 /**
@@ -1097,16 +1631,21 @@ static inline void dump_constate(struct constate** arg_con) /* Print all the con
  * Just the basic information - Ahmad
  */
 
-static inline void display_connections_info(struct constate** arg_con) {
+static inline void display_connections_info(struct constate_table* table) {
 
-  struct constate *node = *arg_con;
+  struct constate_hash *hash;
+  struct constate *node;
+  struct hlist_node *pos;
+  unsigned int bucket;
 
   printk (KERN_INFO "Starting to print all connections\n");
   printk (KERN_INFO "====================================================================================================================================================\n");
   printk (KERN_INFO "ID \t State Name     (State#) \t RTT  \t RTT Var +/- \t Data \t FR-N \t FR-TD \t FR-PT \t FR-In \t Choke  PSMT State \t Min T \t Scale \t PSMT \t Idle \t Destination IP\n");
   printk (KERN_INFO "-- \t ----------------------- \t ---- \t ----------- \t ---- \t ---- \t ----- \t ----- \t ----- \t -----  ---------- \t ----- \t ----- \t ---- \t ---- \t --------------\n");
 
-  while (node != NULL) {
+  rcu_read_lock();
+  hash = rcu_dereference(table->hash);
+  for_each_connection_rcu(hash, node, bucket, pos) {
 
 
     //		if ((node->state & THROTTLE_DETECTION) || (node->state & PSMT)) { // show only active connections
@@ -1118,26 +1657,26 @@ static inline void display_connections_info(struct constate** arg_con) {
             node->connection_id,
             get_current_state_name(node->state),
             node->state,
-            node->rtt/1000, 						// from tcp_info
-            ((node->rtt_var/1000) > 9999) ? 9999 : node->rtt_var/1000,					// from tcp_info
+            node->cold->rtt/1000, 						// from tcp_info
+            ((node->cold->rtt_var/1000) > 9999) ? 9999 : node->cold->rtt_var/1000,					// from tcp_info
             node->temp_data_arrived/1024,
-            node->flow_rate_normal/1024,
-            node->flow_rate_td/1024,
-            node->flow_rate_psmt/1024,
-            node->flow_rate_inst/1024,
-            node->choke_state,get_choke_state_name(node->choke_state),
-            node->psmt_state,get_psmt_state_name(node->psmt_state),
-            node->min_psmt_throughput, //node->burst_time,
+            node->cold->flow_rate_normal/1024,
+            node->cold->flow_rate_td/1024,
+            node->cold->flow_rate_psmt/1024,
+            node->cold->flow_rate_inst/1024,
+            node->cold->choke_state,get_choke_state_name(node->cold->choke_state),
+            node->cold->psmt_state,get_psmt_state_name(node->cold->psmt_state),
+            node->cold->min_psmt_throughput, //node->cold->burst_time,
             node->window_scale,
-            //				node->connection_time_lapsed/1000,
-            node->psmt_time_lapsed/1000,
-            node->total_idle_time/1000,
-            IPCOMP(node->dst_addr, 0), IPCOMP(node->dst_addr, 1), IPCOMP(node->dst_addr, 2), IPCOMP(node->dst_addr, 3)
+            //				node->cold->connection_time_lapsed/1000,
+            node->cold->psmt_time_lapsed/1000,
+            node->cold->total_idle_time/1000,
+            IPCOMP(node->cold->dst_addr, 0), IPCOMP(node->cold->dst_addr, 1), IPCOMP(node->cold->dst_addr, 2), IPCOMP(node->cold->dst_addr, 3)
             );
     //	}
 
-    node = node->next;
   }
+  rcu_read_unlock();
   printk (KERN_INFO "====================================================================================================================================================\n");
 
   /* if (EMULATE_WNIC) { */
@@ -1151,24 +1690,15 @@ static inline void display_connections_info(struct constate** arg_con) {
 
 }
 
-static inline int count(struct constate** arg_con) {
-  int con = 0;
-  struct constate *temp = *arg_con;
-  while (temp != NULL) {
-
-    con++;
-    temp = temp->next;
-  }
-
-  printk(KERN_INFO" Connection id %d", temp->connection_id);
-  return con;
+static inline int count(struct constate_table* table) {
+  return table->count;
 }
 
-static inline void update_flow_rate_normal(struct constate* node){
+static inline void update_flow_rate_normal(struct constate* node, u64 now){
 
   struct constate * connection = node;
 
-  u_int32_t time_period = jiffies_to_msecs(jiffies - connection->connection_start_time);
+  u_int32_t time_period = tm_ms_since(connection->cold->connection_start_time, now);
 
   //	u_int64_t temp_fr = 0;
 
@@ -1184,22 +1714,22 @@ static inline void update_flow_rate_normal(struct constate* node){
      */
     //		temp_fr = (connection->temp_data_arrived * 1000);
     //		do_div(temp_fr,time_period);
-    //		connection->flow_rate_normal = temp_fr;
+    //		connection->cold->flow_rate_normal = temp_fr;
 
-    connection->flow_rate_normal = (connection->temp_data_arrived/ time_period )  * 1000;
+    connection->cold->flow_rate_normal = (connection->temp_data_arrived/ time_period )  * 1000;
 
     //		printk(" -- total_data: %d, time_period: %d, flow_rate_normal: %d\n",
-    //				connection->total_data_arrived, time_period, connection->flow_rate_normal);
+    //				connection->total_data_arrived, time_period, connection->cold->flow_rate_normal);
 
   }
 
 }
 
-static inline void update_flow_rate_td(struct constate* node){
+static inline void update_flow_rate_td(struct constate* node, u64 now){
 
   struct constate * connection = node;
 
-  u_int32_t time_period = jiffies_to_msecs(jiffies - connection->td_start_time);
+  u_int32_t time_period = tm_ms_since(connection->cold->td_start_time, now);
   //	u_int64_t temp_fr = 0;
 
   if (node == NULL) return;
@@ -1207,25 +1737,25 @@ static inline void update_flow_rate_td(struct constate* node){
   /*
    * Calculate the rate of data being transfered
    */
-  if (connection->burst_time > 0) { //sanity checks
+  if (connection->cold->burst_time > 0) { //sanity checks
 
     //		temp_fr = (connection->data_arrived_td * 1000);
     //		do_div(temp_fr,time_period);
-    //		connection->flow_rate_td = temp_fr;
+    //		connection->cold->flow_rate_td = temp_fr;
 
-    connection->flow_rate_td = (connection->data_arrived_td	/ time_period)  * 1000;
+    connection->cold->flow_rate_td = (connection->data_arrived_td	/ time_period)  * 1000;
 
     //		printk(" -- data_td: %d, burst_time: %d, flow_rate_td: %d\n",
-    //						connection->data_arrived_td, time_period, connection->flow_rate_td);
+    //						connection->data_arrived_td, time_period, connection->cold->flow_rate_td);
 
   }
 }
 
-static inline void update_flow_rate_psmt(struct constate* node){
+static inline void update_flow_rate_psmt(struct constate* node, u64 now){
 
   struct constate * connection = node;
 
-  u_int32_t time_period = jiffies_to_msecs(jiffies - connection->psmt_start_time);
+  u_int32_t time_period = tm_ms_since(connection->cold->psmt_start_time, now);
   //	u_int64_t temp_fr = 0;
 
   if (node == NULL) return;
@@ -1241,12 +1771,12 @@ static inline void update_flow_rate_psmt(struct constate* node){
 
     //		temp_fr = (connection->temp_data_arrived * 1000);
     //		do_div(temp_fr,time_period);
-    //		connection->flow_rate_psmt = temp_fr;
+    //		connection->cold->flow_rate_psmt = temp_fr;
 
-    connection->flow_rate_psmt = (connection->temp_data_arrived	/ time_period )  * 1000;
+    connection->cold->flow_rate_psmt = (connection->temp_data_arrived	/ time_period )  * 1000;
 
     //		printk(" -- data: %d, time_period: %d, flow_rate_psmt: %d\n",
-    //				connection->temp_data_arrived, time_period, connection->flow_rate_psmt);
+    //				connection->temp_data_arrived, time_period, connection->cold->flow_rate_psmt);
 
   }
 
@@ -1261,10 +1791,10 @@ static inline u_int32_t calculate_window_size(u_int32_t flowrate_normal , u_int3
 static inline void reduce_window_size(struct constate * connection){
 
   if (connection == NULL) return;
-  if ( (signed int)( connection->psmt_window_size - connection->tcpi_rcv_mss)	>= ( signed int)connection->psmt_window_size_min) { // casting to int to get signed values
+  if ( (signed int)( connection->cold->psmt_window_size - connection->cold->tcpi_rcv_mss)	>= ( signed int)connection->cold->psmt_window_size_min) { // casting to int to get signed values
 
-    connection->psmt_window_size -= connection->tcpi_rcv_mss;
-    printk(	" -- Dec WinSize <psmt_window_size : %u , psmt_window_size_min : %u> \n",connection->psmt_window_size, connection->psmt_window_size_min);
+    connection->cold->psmt_window_size -= connection->cold->tcpi_rcv_mss;
+    printk(	" -- Dec WinSize <psmt_window_size : %u , psmt_window_size_min : %u> \n",connection->cold->psmt_window_size, connection->cold->psmt_window_size_min);
   }
 
 }
@@ -1279,14 +1809,19 @@ static inline void reduce_window_size(struct constate * connection){
  * to remain idle for more than a certain amount of time.
  * -Ahmad
  */
-static inline int sleep_wnic_check(struct constate** arg_con, u_int32_t arg_con_id ) {
+static inline int sleep_wnic_check(struct constate_table* table, u_int32_t arg_con_id ) {
 
-  struct constate *node = *arg_con;
+  struct constate_hash *hash;
+  struct constate *node;
+  struct hlist_node *pos;
+  unsigned int bucket;
   //unsigned long time_to_wake = 0;
 
-  while (node != NULL) {
+  rcu_read_lock();
+  hash = rcu_dereference(table->hash);
+  for_each_connection_rcu(hash, node, bucket, pos) {
 
-    if (node->idle_state == NOT_IDLE) {
+    if (node->cold->idle_state == NOT_IDLE) {
 
       /* if (EMULATE_WNIC) { */
       /* 	/\* */
@@ -1312,26 +1847,26 @@ static inline int sleep_wnic_check(struct constate** arg_con, u_int32_t arg_con_
 
     }
 
-    //		else if (node->idle_state == IDLE){
+    //		else if (node->cold->idle_state == IDLE){
     //			/*
     //			 * Check if all connections will remain idle
     //			 * for more than a specific amount of time
     //			 * i.e Transition time from sleep to wake state
     //			 */
-    //			time_to_wake = node->wake_timestamp - jiffies;
+    //			time_to_wake = node->cold->wake_timestamp - jiffies;
     //			if (jiffies_to_msecs(time_to_wake) <= TRANSITION_TIME_SLEEP_TO_WAKE) {
     //				 /*
     //				  * if jiffies is more than the wake_timestamp, it can cause probs
     //				  * but no.. because the vars are unsigned and the result will be huge !
     //				  * instead of -ve.. hence satisfying the condition.
     //				  */
-    //				printk(KERN_INFO "--- time to wake : %d (%d msecs), wake_timestamp: %d \n", time_to_wake, jiffies_to_msecs(time_to_wake), node->wake_timestamp);
+    //				printk(KERN_INFO "--- time to wake : %d (%d msecs), wake_timestamp: %d \n", time_to_wake, jiffies_to_msecs(time_to_wake), node->cold->wake_timestamp);
     //				return 0;
     //			}
     //		}
 
-    node = node->next;
   }
+  rcu_read_unlock();
 
   return 1;
 }
@@ -1347,17 +1882,16 @@ static inline int sleep_wnic_check(struct constate** arg_con, u_int32_t arg_con_
  * If true, the transition times are subtracted from the
  * total idle time (only if EMULATE_WNIC is 1)
  */
-static inline void scheduler(struct constate * node, int idle_state, char * log_message){
+static inline void scheduler(struct constate * node, int idle_state, char * log_message, u64 now){
 
   struct constate * connection = node;
   u_int32_t connection_idle_period = 0;
   u_int32_t wnic_idle_period = 0;
-  //unsigned long now_timestamp = jiffies;
 
   if (node == NULL) return; // sanity
 
-  node->connection_time_lapsed = jiffies_to_msecs(jiffies - connection->connection_start_time);
-  node->psmt_time_lapsed = jiffies_to_msecs(jiffies - connection->psmt_start_time);
+  node->cold->connection_time_lapsed = tm_ms_since(connection->cold->connection_start_time, now);
+  node->cold->psmt_time_lapsed = tm_ms_since(connection->cold->psmt_start_time, now);
 
   /* if (EMULATE_WNIC && wnic->initial_timestamp){ */
   /* 	wnic->time_lapsed = jiffies_to_msecs(jiffies-wnic->initial_timestamp); */
@@ -1370,12 +1904,12 @@ static inline void scheduler(struct constate * node, int idle_state, char * log_
      * change the idle_state of the connection
      * it has nothing to do with wnic state
      */
-    if (node->idle_state == NOT_IDLE) {
-      node->idle_state = IDLE;
+    if (node->cold->idle_state == NOT_IDLE) {
+      node->cold->idle_state = IDLE;
       //			if (account_for_transitions) {
-      //				node->total_idle_time -= TRANSITION_TIME_WAKE_TO_SLEEP;
+      //				node->cold->total_idle_time -= TRANSITION_TIME_WAKE_TO_SLEEP;
       //			}
-      node->sleep_timestamp = jiffies; // start sleeping
+      node->cold->sleep_timestamp = now; // start sleeping
     }
 
     /*
@@ -1390,7 +1924,7 @@ static inline void scheduler(struct constate * node, int idle_state, char * log_
     /* 				 * to remain in the same state, transition wnic */
     /* 				 * to sleep state */
     /* 				 *\/ */
-    /* 				if (sleep_wnic_check(&all_connections_head, node->connection_id)) { */
+    /* 				if (sleep_wnic_check(&all_connections, node->connection_id)) { */
     /* 					wnic->idle_state = IDLE; */
 
     /* //					if (account_for_transitions) { */
@@ -1407,7 +1941,7 @@ static inline void scheduler(struct constate * node, int idle_state, char * log_
     //		} else {
 
     /* if (is_wnic_sleep()) { */
-    /* 	if (sleep_wnic_check(&all_connections_head, node->connection_id)) { */
+    /* 	if (sleep_wnic_check(&all_connections, node->connection_id)) { */
     /* 		wni_control(IDLE); */
     /* 		printk("SLEEP : %s\n", log_message); */
     /* 	} else { */
@@ -1423,13 +1957,13 @@ static inline void scheduler(struct constate * node, int idle_state, char * log_
     /*
      * Connection idle_state
      */
-    if (node->idle_state == IDLE) {
-      node->idle_state = NOT_IDLE;
-      connection_idle_period = jiffies_to_msecs(jiffies - node->sleep_timestamp);
-      node->total_idle_time += connection_idle_period;
+    if (node->cold->idle_state == IDLE) {
+      node->cold->idle_state = NOT_IDLE;
+      connection_idle_period = tm_ms_since(node->cold->sleep_timestamp, now);
+      node->cold->total_idle_time += connection_idle_period;
 
       //			if (account_for_transitions) {
-      //				node->total_idle_time -= TRANSITION_TIME_SLEEP_TO_WAKE;
+      //				node->cold->total_idle_time -= TRANSITION_TIME_SLEEP_TO_WAKE;
       //			}
 
     }
@@ -1461,9 +1995,9 @@ static inline void scheduler(struct constate * node, int idle_state, char * log_
     /* 				 *\/ */
     /* 				printk("%ludconnection%d|%d|%d|%lud \n", test_identifier, */
     /* 										node->connection_id, */
-    /* 										node->connection_time_lapsed, */
-    /* 										node->total_idle_time, */
-    /* 										node->flow_rate_psmt); */
+    /* 										node->cold->connection_time_lapsed, */
+    /* 										node->cold->total_idle_time, */
+    /* 										node->cold->flow_rate_psmt); */
 
     /* 				printk("%ludwnic|%d|%ud| \n", test_identifier, */
     /* 						wnic->time_lapsed, */
@@ -1482,8 +2016,8 @@ static inline void scheduler(struct constate * node, int idle_state, char * log_
     //	 * The EMULATE cases are only called if the WNIC is being emulated
     //	 */
     //	case EMULATE_SINGLE_PACKET:
-    //		if (node->idle_state == IDLE){
-    //			node->total_idle_time -= SEND_SINGLE_PACKET_TIME;
+    //		if (node->cold->idle_state == IDLE){
+    //			node->cold->total_idle_time -= SEND_SINGLE_PACKET_TIME;
     //		}
     //
     //		if (wnic->idle_state == IDLE){
@@ -1519,11 +2053,14 @@ static inline void sleep_timer_function(unsigned long data) {
   struct constate *connection = (struct constate *) data;
   if (connection == NULL) return;
 
+  trace_tm_timer(connection->connection_id, "sleep", connection->state,
+                 connection->cold->choke_state, connection->cold->psmt_state);
+
   /*
    * Set the wifi device to awake mode
    * (if in Sleep Mode at the moment)
    */
-  scheduler(connection, NOT_IDLE, "sleep timer up.. waking up");
+  scheduler(connection, NOT_IDLE, "sleep timer up.. waking up", tm_now());
 
 }
 
@@ -1539,8 +2076,8 @@ static inline void modify_sleep_timer(struct constate *connection, const unsigne
 
   unsigned long expires = jiffies + msecs_to_jiffies(wait_time);
 
-  mod_timer(&connection->sleep_timer, expires);
-  connection->wake_timestamp = expires;
+  mod_timer(&connection->cold->sleep_timer, expires);
+  connection->cold->wake_timestamp = expires;
 }
 
 
@@ -1561,11 +2098,14 @@ static inline void wake_timer_function(unsigned long data) {
   struct constate *connection = (struct constate *) data;
   if (connection == NULL) return;
 
+  trace_tm_timer(connection->connection_id, "wake", connection->state,
+                 connection->cold->choke_state, connection->cold->psmt_state);
+
   /*
    * Set the wifi device to sleep mode after having staying
    * up for specified amount of time
    */
-  scheduler(connection, IDLE, "Advertised.. going back to sleep");
+  scheduler(connection, IDLE, "Advertised.. going back to sleep", tm_now());
 
 }
 
@@ -1586,28 +2126,32 @@ static inline void timer_function(unsigned long data) {
 
   struct constate *node = (struct constate *) data;
   if (node != NULL) {
+    u64 now = tm_now();
+
+    trace_tm_timer(node->connection_id, "state", node->state,
+                   node->cold->choke_state, node->cold->psmt_state);
 
     if (node->state == (SYNED | ACKED | ESTABLISHED)) {
 
-      if (node->choke_state == NO_OP) {
+      if (node->cold->choke_state == NO_OP) {
 
-        node->choke_state = CALC_FLOWRATE;
+        node->cold->choke_state = CALC_FLOWRATE;
 
-        mod_timer(&node->timer, jiffies
+        mod_timer(&node->cold->timer, jiffies
                   + msecs_to_jiffies(calc_flowrate_wait));
 
-        node->flow_rate_normal = 0;
+        node->cold->flow_rate_normal = 0;
         node->temp_data_arrived = 0;
-        node->connection_start_time = jiffies;
+        node->cold->connection_start_time = now;
 
-      } else if (node->choke_state == CALC_FLOWRATE) {
+      } else if (node->cold->choke_state == CALC_FLOWRATE) {
 
         if (node->total_packet_count >= PACKET_COUNT_THRESHOLD
             && node->temp_data_arrived >= DATA_THRESHOLD) {
 
           node->state |= THROTTLE_DETECTION;
-          node->choke_state = PRE_CHOKE;
-          node->td_start_time = jiffies;
+          node->cold->choke_state = PRE_CHOKE;
+          node->cold->td_start_time = now;
         }
 
       }
@@ -1619,16 +2163,16 @@ static inline void timer_function(unsigned long data) {
        * the flow rate for the bursty traffic after
        * choking the connection once.
        */
-      node->choke_state = NO_OP;
+      node->cold->choke_state = NO_OP;
 
-      if (node->flow_rate_normal == 0 || node->flow_rate_td == 0){
+      if (node->cold->flow_rate_normal == 0 || node->cold->flow_rate_td == 0){
 
         node->state |= NORMAL;
 
-      } else if ( ENABLE_PSM_THROTTLING(node->flow_rate_normal, node->flow_rate_td,BANDWIDTH_RATIO ) ){
+      } else if ( ENABLE_PSM_THROTTLING(node->cold->flow_rate_normal, node->cold->flow_rate_td,BANDWIDTH_RATIO ) ){
 
         node->state |= PSMT;
-        node->psmt_state = INITIAL_CHOKE;
+        node->cold->psmt_state = INITIAL_CHOKE;
 
         /*
          * Preparing for PSM State..
@@ -1637,15 +2181,15 @@ static inline void timer_function(unsigned long data) {
          * flow rate during PSMT
          */
         node->temp_data_arrived = 0; // reset the data arrived for calculation of flow rate
-        node->psmt_start_time = jiffies; // mark the time when we enter psmt state
+        node->cold->psmt_start_time = now; // mark the time when we enter psmt state
 
         //				if (EMULATE_WNIC){
         //					if (wnic->initial_timestamp == 0){ // only update the first time
-        //						wnic->initial_timestamp = node->psmt_start_time;
+        //						wnic->initial_timestamp = node->cold->psmt_start_time;
         //					}
         //				}
-        node->psmt_window_size_min = calculate_window_size(node->flow_rate_normal, node->rtt/1000);
-        node->psmt_window_size = node->psmt_window_size_min;
+        node->cold->psmt_window_size_min = calculate_window_size(node->cold->flow_rate_normal, node->cold->rtt/1000);
+        node->cold->psmt_window_size = node->cold->psmt_window_size_min;
 
 
       } else {
@@ -1654,7 +2198,7 @@ static inline void timer_function(unsigned long data) {
 
     }  else if (node->state == (SYNED | ACKED | ESTABLISHED | THROTTLE_DETECTION | PSMT)) {
 
-      switch (node->psmt_state){
+      switch (node->cold->psmt_state){
 
       case INITIAL_CHOKE:
       case INITIAL_WAIT:
@@ -1662,15 +2206,15 @@ static inline void timer_function(unsigned long data) {
          * Preparing for PSM State..
          */
         node->temp_data_arrived = 0; // reset the data arrived for calculation of flow rate
-        node->psmt_start_time = jiffies; // mark the time when we enter psmt state
+        node->cold->psmt_start_time = now; // mark the time when we enter psmt state
 
         /* if (EMULATE_WNIC){ */
         /* 	if (wnic->initial_timestamp == 0){ // only update the first time */
-        /* 		wnic->initial_timestamp = node->psmt_start_time; */
+        /* 		wnic->initial_timestamp = node->cold->psmt_start_time; */
         /* 	} */
         /* } */
-        node->psmt_state = ADVERTISE_WINDOW_SIZE;
-        printk (" ( |/ ) INITIAL_WAIT -> %s\n", get_psmt_state_name(node->psmt_state) );
+        node->cold->psmt_state = ADVERTISE_WINDOW_SIZE;
+        printk (" ( |/ ) INITIAL_WAIT -> %s\n", get_psmt_state_name(node->cold->psmt_state) );
         break;
 
 
@@ -1679,7 +2223,7 @@ static inline void timer_function(unsigned long data) {
          * Do nothing.. connection is already in
          * ADVERTISE_WINDOW_SIZE state.
          */
-        //				printk(" ( |/ ) ADVERTISE_WINDOW_SIZE -> %s\n",	get_psmt_state_name(node->psmt_state));
+        //				printk(" ( |/ ) ADVERTISE_WINDOW_SIZE -> %s\n",	get_psmt_state_name(node->cold->psmt_state));
         break;
 
       case CHOKE:
@@ -1695,16 +2239,16 @@ static inline void timer_function(unsigned long data) {
          */
 
         node->data_arrived_burst = 0;
-        node->psmt_state= ADVERTISE_WINDOW_SIZE;
+        node->cold->psmt_state= ADVERTISE_WINDOW_SIZE;
 
         /*
          * Decrease the psmt min throughput
          */
-        //				if (node->min_psmt_throughput > 50){
-        //					node->min_psmt_throughput -= 1;
+        //				if (node->cold->min_psmt_throughput > 50){
+        //					node->cold->min_psmt_throughput -= 1;
         //				}
         //				reduce_window_size(node);
-        printk (" ( |/ ) RECEIVE_PACKETS -> entering %s state\n", get_psmt_state_name(node->psmt_state) );
+        printk (" ( |/ ) RECEIVE_PACKETS -> entering %s state\n", get_psmt_state_name(node->cold->psmt_state) );
 
 
         break;
@@ -0,0 +1,260 @@
+/* 
+ * This file is part of TrafficMonitor.
+ * 
+ * Copyright (C) 2011, Ahmad Nazir, Mohammad Hoque, Wei Li and Aki Saarinen.
+ * 
+ * TrafficMonitor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * TrafficMonitor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with TrafficMonitor.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CONNVIEW_H_
+#define CONNVIEW_H_
+
+#include <linux/debugfs.h>
+#include <linux/rcupdate.h>
+#include <linux/seq_file.h>
+
+/**
+ * Connection Table View
+ *
+ * /sys/kernel/debug/trafficmonitor/connections lists
+ * every tracked connection, one per line, and
+ * /sys/kernel/debug/trafficmonitor/summary has the
+ * totals of the table. Both only read the table under
+ * rcu_read_lock() like the hooks do, so reading them
+ * never holds up a packet. The values of a connection
+ * are read without its lock and may be a packet apart
+ * from each other.
+ *
+ * Units: rtt and rtt_var in ms, mss in bytes, wscale
+ * as a shift, sack and ts 0 or 1, packets in segments
+ * on the wire, bytes of TCP payload, idle (time since
+ * the last packet) and idle_total in ms.
+ *
+ * Included after connections.h.
+ */
+
+static struct dentry *connections_file = NULL;
+static struct dentry *summary_file = NULL;
+
+/*
+ * Where a read of the connections file is in the
+ * table. Only valid inside the rcu_read_lock() section
+ * taken in ->start, a resumed read finds its place
+ * again with connection_at().
+ */
+struct connections_iter {
+  struct constate_hash *hash;
+  unsigned int bucket;
+};
+
+/*
+ * The first connection at or after 'hpos' in the
+ * current bucket, or in the buckets after it. Called
+ * under rcu_read_lock().
+ */
+static struct constate * connection_from(struct connections_iter *iter, struct hlist_node *hpos)
+{
+  while (hpos == NULL) {
+    if (++iter->bucket >= iter->hash->size)
+      return NULL;
+    hpos = rcu_dereference(iter->hash->buckets[iter->bucket].first);
+  }
+
+  return hlist_entry(hpos, struct constate, hnode);
+}
+
+/*
+ * The connection at position 'pos' of the current
+ * hash, counting from 0. Called under rcu_read_lock().
+ * A table that is being resized may be walked twice or
+ * miss connections, which is fine for a view.
+ */
+static struct constate * connection_at(struct connections_iter *iter, loff_t pos)
+{
+  struct constate *node;
+
+  iter->hash = rcu_dereference(all_connections.hash);
+  iter->bucket = 0;
+
+  node = connection_from(iter, rcu_dereference(iter->hash->buckets[0].first));
+  while (node != NULL && pos-- > 0)
+    node = connection_from(iter, rcu_dereference(node->hnode.next));
+
+  return node;
+}
+
+static void * connections_seq_start(struct seq_file *m, loff_t *pos)
+{
+  rcu_read_lock();
+
+  if (*pos == 0)
+    return SEQ_START_TOKEN;
+
+  return connection_at(m->private, *pos - 1);
+}
+
+/*
+ * Only steps on from the current connection, the whole
+ * listing takes one pass over the table.
+ */
+static void * connections_seq_next(struct seq_file *m, void *v, loff_t *pos)
+{
+  struct constate *node = v;
+
+  (*pos)++;
+
+  if (v == SEQ_START_TOKEN)
+    return connection_at(m->private, 0);
+
+  return connection_from(m->private, rcu_dereference(node->hnode.next));
+}
+
+static void connections_seq_stop(struct seq_file *m, void *v)
+{
+  rcu_read_unlock();
+}
+
+static int connections_seq_show(struct seq_file *m, void *v)
+{
+  struct constate *node = v;
+  struct constate_cold *cold;
+
+  if (v == SEQ_START_TOKEN) {
+    seq_printf(m, "id\tlocal\tremote\tuid\tpid\tstate\tburst_stage\tchoke_state\tpsmt_state\t"
+               "rtt\trtt_var\tmss\twscale\tsack\tts\t"
+               "packets_up\tpackets_down\tbytes_up\tbytes_down\tidle\tidle_total\tchoked\tclosing\n");
+    return 0;
+  }
+
+  cold = node->cold;
+
+  seq_printf(m, "%u\t%pI4:%u\t%pI4:%u\t%d\t%d\t%s\t%u\t%s\t%s\t",
+             node->connection_id,
+             &node->key.local_addr.ip, ntohs(node->key.local_port),
+             &node->key.remote_addr.ip, ntohs(node->key.remote_port),
+             (int) node->uid, node->pid,
+             get_current_state_name(node->state),
+             node->burst_stage,
+             get_choke_state_name(cold->choke_state),
+             get_psmt_state_name(cold->psmt_state));
+
+  seq_printf(m, "%u\t%u\t%u\t%u\t%d\t%d\t",
+             cold->rtt / 1000, cold->rtt_var / 1000,
+             cold->tcpi_rcv_mss, node->window_scale,
+             connection_sack_ok(node), connection_timestamps_ok(node));
+
+  seq_printf(m, "%u\t%u\t%llu\t%llu\t%u\t%u\t%u\t%u\n",
+             node->flow_packets[0], node->flow_packets[1],
+             (unsigned long long) node->flow_bytes[0],
+             (unsigned long long) node->flow_bytes[1],
+             jiffies_to_msecs(jiffies - node->last_seen),
+             cold->total_idle_time,
+             node->chocked ? 1 : 0, node->closing ? 1 : 0);
+
+  return 0;
+}
+
+static const struct seq_operations connections_seq_ops = {
+  .start = connections_seq_start,
+  .next = connections_seq_next,
+  .stop = connections_seq_stop,
+  .show = connections_seq_show,
+};
+
+static int connections_open(struct inode *inode, struct file *file)
+{
+  return seq_open_private(file, &connections_seq_ops, sizeof(struct connections_iter));
+}
+
+static const struct file_operations connections_fops = {
+  .owner = THIS_MODULE,
+  .open = connections_open,
+  .read = seq_read,
+  .llseek = seq_lseek,
+  .release = seq_release_private,
+};
+
+static int summary_show(struct seq_file *m, void *v)
+{
+  struct constate_table *table = &all_connections;
+  struct constate_hash *hash;
+  struct constate *node;
+  struct hlist_node *pos;
+  unsigned int bucket;
+  unsigned int stages[FIN + 1] = { 0 };
+  unsigned int choked = 0, closing = 0, idle = 0;
+
+  rcu_read_lock();
+  hash = rcu_dereference(table->hash);
+
+  for_each_connection_rcu(hash, node, bucket, pos) {
+    if (node->burst_stage <= FIN)
+      stages[node->burst_stage]++;
+    if (node->chocked)
+      choked++;
+    if (node->closing)
+      closing++;
+    if (node->cold->idle_state == IDLE)
+      idle++;
+  }
+
+  seq_printf(m, "connections %u\n", count(table));
+  seq_printf(m, "buckets %u\n", hash->size);
+  rcu_read_unlock();
+
+  seq_printf(m, "burst_stage no_connection %u syn %u syn_ack %u established %u request %u start %u fin %u\n",
+             stages[BURST_NO_CONNECTION], stages[SYN], stages[SYN_ACK], stages[BURST_ESTABLISHED],
+             stages[BURST_REQUEST], stages[BURST_START], stages[FIN]);
+  seq_printf(m, "choked %u\n", choked);
+  seq_printf(m, "closing %u\n", closing);
+  seq_printf(m, "idle %u\n", idle);
+  seq_printf(m, "allocation_failures %d\n", atomic_read(&connection_alloc_failures));
+  seq_printf(m, "reaped_closed %lu\n", reaped_closed_connections);
+  seq_printf(m, "reaped_idle %lu\n", reaped_idle_connections);
+
+  return 0;
+}
+
+static int summary_open(struct inode *inode, struct file *file)
+{
+  return single_open(file, summary_show, NULL);
+}
+
+static const struct file_operations summary_fops = {
+  .owner = THIS_MODULE,
+  .open = summary_open,
+  .read = seq_read,
+  .llseek = seq_lseek,
+  .release = single_release,
+};
+
+static void init_connection_view(struct dentry *parent)
+{
+  connections_file = debugfs_create_file("connections", 0444, parent, NULL, &connections_fops);
+  summary_file = debugfs_create_file("summary", 0444, parent, NULL, &summary_fops);
+}
+
+/*
+ * Called on module exit before the table is freed,
+ * removing a file waits for its readers.
+ */
+static void destroy_connection_view(void)
+{
+  debugfs_remove(connections_file);
+  debugfs_remove(summary_file);
+  connections_file = NULL;
+  summary_file = NULL;
+}
+
+#endif /* CONNVIEW_H_ */
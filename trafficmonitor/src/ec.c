@@ -24,6 +24,8 @@
 #include <linux/netlink.h>
 #include <linux/time.h>
 #include <net/sock.h>
+#include <net/netlink.h>
+#include <net/genetlink.h>
 #include <net/net_namespace.h>
 
 
@@ -37,6 +39,11 @@
 #include <linux/delay.h>	// void msleep(unsigned int sleep_time);
 #include <linux/debugfs.h>
 #include <linux/uaccess.h>
+#include <linux/hrtimer.h>
+#include <linux/interrupt.h>	// tasklet_hrtimer
+#include <linux/percpu.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
 
 /**
  * Wireless Extensions
@@ -49,163 +56,776 @@
  * Local includes
  */
 #include "ec.h"
+#include "events.h"
+#include "stats.h"
+#include "ringbuf.h"
+#include "eventqueue.h"
+#include "bursts.h"
+#include "packet.h"
+#include "filter.h"
+#include "choke.h"
+
+// Defines the tracepoints, must come before the headers that use them
+#define CREATE_TRACE_POINTS
+#include "tm_trace.h"
+
 #include "connections.h"
+#include "connview.h"
 #include "nfhooks.h"
 
-#define MAX_PAYLOAD 2000
+static struct dentry *debugfs_root = NULL;	// /sys/kernel/debug/trafficmonitor
 
-static struct sock *nl_sk = NULL;
-static int pid;
-static bool gotPID = false;
 
-static void processRequest (struct sk_buff *skb)
-{  
-  struct nlmsghdr *nlh = NULL;
-  if(skb == NULL)
-  {
-    printk("TM: skb is NULL \n");
-    return ;
+/**
+ * Generic Netlink Family
+ *
+ * The user space talks to the module through the
+ * generic netlink family TM_GENL_NAME, see events.h for
+ * the commands and attributes. Events go out to the
+ * multicast group tm_events_group, so every reader that
+ * has joined it gets the same stream.
+ */
+static struct genl_family tm_genl_family = {
+  .id = GENL_ID_GENERATE,
+  .hdrsize = 0,
+  .name = TM_GENL_NAME,
+  .version = TM_GENL_VERSION,
+  .maxattr = TM_A_MAX,
+};
+
+static struct genl_multicast_group tm_events_group = {
+  .name = TM_GENL_GROUP_EVENTS,
+};
+
+static struct genl_multicast_group tm_control_group = {
+  .name = TM_GENL_GROUP_CONTROL,
+};
+
+static const struct nla_policy tm_genl_policy[TM_A_MAX + 1] = {
+  [TM_A_EVENTS] = { .type = NLA_BINARY },
+  [TM_A_CHOKE] = { .type = NLA_U8 },
+  [TM_A_FILTER_ACTION] = { .type = NLA_U8 },
+  [TM_A_FILTER_DIRECTIONS] = { .type = NLA_U8 },
+  [TM_A_FILTER_LOCAL_PORT_MIN] = { .type = NLA_U16 },
+  [TM_A_FILTER_LOCAL_PORT_MAX] = { .type = NLA_U16 },
+  [TM_A_FILTER_REMOTE_PORT_MIN] = { .type = NLA_U16 },
+  [TM_A_FILTER_REMOTE_PORT_MAX] = { .type = NLA_U16 },
+  [TM_A_FILTER_UID] = { .type = NLA_U32 },
+  [TM_A_FILTER_MIN_PAYLOAD] = { .type = NLA_U32 },
+  [TM_A_FILTER_MAX_PAYLOAD] = { .type = NLA_U32 },
+  [TM_A_CHOKE_TIMEOUT] = { .type = NLA_U32 },
+};
+
+/*
+ * Is anybody listening to the events?
+ */
+static inline bool tm_listening(void)
+{
+  return netlink_has_listeners(init_net.genl_sock, tm_events_group.id);
+}
+
+/*
+ * Build a TM_CMD_CHOKE message with the current
+ * choke state.
+ */
+static struct sk_buff * choke_message(u32 pid, u32 seq)
+{
+  struct sk_buff *skb;
+  void *hdr;
+
+  skb = genlmsg_new(nla_total_size(sizeof(u8)), GFP_KERNEL);
+  if (skb == NULL)
+    return NULL;
+
+  hdr = genlmsg_put(skb, pid, seq, &tm_genl_family, 0, TM_CMD_CHOKE);
+  if (hdr == NULL || nla_put_u8(skb, TM_A_CHOKE, OnChocking ? 1 : 0) < 0) {
+    kfree_skb(skb);
+    return NULL;
   }
-  
-  nlh = (struct nlmsghdr *)skb->data;
-  printk(KERN_INFO "TM: %s: received netlink message payload: %s\n", __FUNCTION__, NLMSG_DATA(nlh));
-  
-  char *payload = (char*)NLMSG_DATA(nlh);
 
-  // The request type.
-  // 0 means initial request.
-  // 1 means set window size zero request.
-  // 2 means restore window size request
-  int request;
+  genlmsg_end(skb, hdr);
+  return skb;
+}
 
+static int tm_set_choke(struct sk_buff *skb, struct genl_info *info)
+{
+  struct sk_buff *notification;
 
-  sscanf(payload, "%d", &request);
+  if (info->attrs[TM_A_CHOKE] == NULL)
+    return -EINVAL;
 
-  if(0 == request)
-  {
-  // 0 means this is an initial message sent from user space program to indicate the PID
-    nlh=(struct nlmsghdr*)skb->data;
-    pid = nlh->nlmsg_pid; /*pid of sending process */
-    printk(KERN_INFO "TM: Received user space initial message. The PID is %d \n", pid);
-    gotPID = true;
-  }
-  else if(1 == request)
-  {     //  case 1: // 1 means this is a request to set the windows size to zero
-    OnChocking = true;
+  OnChocking = nla_get_u8(info->attrs[TM_A_CHOKE]) != 0;
+
+  if (OnChocking) {
     printk(KERN_INFO "Window Size: Received user space request to set windows size to zero\n");
-  }
-  
-  else if(2 == request)
-  {     //  case 2: // 2 means this is a request to recover the windows size to previous values
-    OnChocking = false;
+  } else {
     printk(KERN_INFO "Window Size: Received user space request to recover the windows size\n");
+    restore_choked_soon();
   }
-  
-  else
-    printk(KERN_ERR "TM: Invalid request type with value\n");
+
+  // Let the other readers know, nobody listening is fine
+  notification = choke_message(0, 0);
+  if (notification != NULL)
+    genlmsg_multicast(notification, 0, tm_control_group.id, GFP_KERNEL);
+
+  return 0;
 }
 
+static int tm_get_choke(struct sk_buff *skb, struct genl_info *info)
+{
+  struct sk_buff *reply = choke_message(info->snd_pid, info->snd_seq);
+
+  if (reply == NULL)
+    return -ENOMEM;
 
-void newPacket(u_int32_t connection_id, unsigned int size, int direction, bool newConnection)
+  return genlmsg_reply(reply, info);
+}
+
+static inline bool valid_filter_action(u_int8_t action)
 {
+  return action == TM_FILTER_INCLUDE || action == TM_FILTER_EXCLUDE;
+}
 
-  if( direction>1 || direction<0 )
+/*
+ * Fill in the port and uid conditions of a rule from
+ * the request. Returns how many of them were given.
+ */
+static int get_rule_match(struct nlattr **attrs, struct tm_filter_rule *rule)
+{
+  int given = 0;
+
+  if (attrs[TM_A_FILTER_LOCAL_PORT_MIN]) {
+    rule->local_port_min = nla_get_u16(attrs[TM_A_FILTER_LOCAL_PORT_MIN]);
+    given++;
+  }
+  if (attrs[TM_A_FILTER_LOCAL_PORT_MAX]) {
+    rule->local_port_max = nla_get_u16(attrs[TM_A_FILTER_LOCAL_PORT_MAX]);
+    given++;
+  }
+  if (attrs[TM_A_FILTER_REMOTE_PORT_MIN]) {
+    rule->remote_port_min = nla_get_u16(attrs[TM_A_FILTER_REMOTE_PORT_MIN]);
+    given++;
+  }
+  if (attrs[TM_A_FILTER_REMOTE_PORT_MAX]) {
+    rule->remote_port_max = nla_get_u16(attrs[TM_A_FILTER_REMOTE_PORT_MAX]);
+    given++;
+  }
+  if (attrs[TM_A_FILTER_UID]) {
+    rule->uid = nla_get_u32(attrs[TM_A_FILTER_UID]);
+    given++;
+  }
+
+  return given;
+}
+
+static int tm_add_filter(struct sk_buff *skb, struct genl_info *info)
+{
+  struct nlattr **attrs = info->attrs;
+  struct tm_filter_rule rule;
+
+  if (attrs[TM_A_FILTER_ACTION] == NULL)
+    return -EINVAL;
+
+  init_filter_rule(&rule, nla_get_u8(attrs[TM_A_FILTER_ACTION]));
+  if (!valid_filter_action(rule.action))
+    return -EINVAL;
+
+  if (attrs[TM_A_FILTER_DIRECTIONS])
+    rule.directions = nla_get_u8(attrs[TM_A_FILTER_DIRECTIONS]);
+  get_rule_match(attrs, &rule);
+  if (attrs[TM_A_FILTER_MIN_PAYLOAD])
+    rule.min_payload = nla_get_u32(attrs[TM_A_FILTER_MIN_PAYLOAD]);
+  if (attrs[TM_A_FILTER_MAX_PAYLOAD])
+    rule.max_payload = nla_get_u32(attrs[TM_A_FILTER_MAX_PAYLOAD]);
+
+  return add_filter_rule(&rule);
+}
+
+static int tm_clear_filter(struct sk_buff *skb, struct genl_info *info)
+{
+  u_int8_t action = TM_FILTER_INCLUDE;
+
+  if (info->attrs[TM_A_FILTER_ACTION])
+    action = nla_get_u8(info->attrs[TM_A_FILTER_ACTION]);
+  if (!valid_filter_action(action))
+    return -EINVAL;
+
+  return clear_filter(action);
+}
+
+static int tm_add_choke(struct sk_buff *skb, struct genl_info *info)
+{
+  struct tm_filter_rule match;
+  u_int32_t timeout_ms = 0;
+
+  init_filter_rule(&match, TM_FILTER_INCLUDE);
+  get_rule_match(info->attrs, &match);
+  if (info->attrs[TM_A_CHOKE_TIMEOUT])
+    timeout_ms = nla_get_u32(info->attrs[TM_A_CHOKE_TIMEOUT]);
+
+  return add_choke_policy(&match, timeout_ms);
+}
+
+static int tm_release_choke(struct sk_buff *skb, struct genl_info *info)
+{
+  struct tm_filter_rule match;
+
+  init_filter_rule(&match, TM_FILTER_INCLUDE);
+  if (get_rule_match(info->attrs, &match) == 0)
+    return release_choke_policies(NULL);
+
+  return release_choke_policies(&match);
+}
+
+static struct genl_ops tm_genl_ops[] = {
   {
-    printk(KERN_ERR "TM: packet direction error\n");
+    .cmd = TM_CMD_SET_CHOKE,
+    .flags = GENL_ADMIN_PERM,
+    .policy = tm_genl_policy,
+    .doit = tm_set_choke,
+  },
+  {
+    .cmd = TM_CMD_GET_CHOKE,
+    .policy = tm_genl_policy,
+    .doit = tm_get_choke,
+  },
+  {
+    .cmd = TM_CMD_ADD_FILTER,
+    .flags = GENL_ADMIN_PERM,
+    .policy = tm_genl_policy,
+    .doit = tm_add_filter,
+  },
+  {
+    .cmd = TM_CMD_CLEAR_FILTER,
+    .flags = GENL_ADMIN_PERM,
+    .policy = tm_genl_policy,
+    .doit = tm_clear_filter,
+  },
+  {
+    .cmd = TM_CMD_ADD_CHOKE,
+    .flags = GENL_ADMIN_PERM,
+    .policy = tm_genl_policy,
+    .doit = tm_add_choke,
+  },
+  {
+    .cmd = TM_CMD_RELEASE_CHOKE,
+    .flags = GENL_ADMIN_PERM,
+    .policy = tm_genl_policy,
+    .doit = tm_release_choke,
+  },
+};
+
+static int register_genl_family(void)
+{
+  int i, err;
+
+  err = genl_register_family(&tm_genl_family);
+  if (err)
+    return err;
+
+  for (i = 0; i < ARRAY_SIZE(tm_genl_ops); i++) {
+    err = genl_register_ops(&tm_genl_family, &tm_genl_ops[i]);
+    if (err)
+      goto failure;
+  }
+
+  err = genl_register_mc_group(&tm_genl_family, &tm_events_group);
+  if (err)
+    goto failure;
+
+  err = genl_register_mc_group(&tm_genl_family, &tm_control_group);
+  if (err)
+    goto failure;
+
+  return 0;
+
+ failure:
+  // Takes the ops and groups registered so far with it
+  genl_unregister_family(&tm_genl_family);
+  return err;
+}
+
+
+/**
+ * Event Batching
+ *
+ * Instead of one netlink message per packet, the events
+ * are collected per CPU into a single TM_CMD_EVENTS
+ * message whose TM_A_EVENTS attribute is an array of
+ * struct tm_event. The
+ * message is sent when it holds batch_bytes worth of
+ * events, or batch_timeout_us after its first event,
+ * whichever comes first. Each message starts with a
+ * TM_EVENT_CLOCK record. The reader splits the payload
+ * back into events, see tm_event_count() in events.h.
+ *
+ * A batch is only touched on its own CPU with the
+ * bottom halves disabled: by send_queued_events() and
+ * by the flush timer, which is a tasklet_hrtimer and
+ * hence runs in softirq context. The timer is pinned,
+ * so it can not migrate to another CPU.
+ *
+ * batch_bytes of 0 sends every event right away.
+ */
+static unsigned int batch_bytes = 4096;
+module_param(batch_bytes, uint, 0644);
+MODULE_PARM_DESC(batch_bytes, "Send the batched events once they take this many bytes, 0 disables batching");
+
+static unsigned int batch_timeout_us = 10000;
+module_param(batch_timeout_us, uint, 0644);
+MODULE_PARM_DESC(batch_timeout_us, "Send the batched events at the latest this long after the first one (us)");
+
+// Largest batch that fits in one attribute
+#define BATCH_MAX_BYTES (0xffff - NLA_HDRLEN)
+
+struct tm_batch {
+  struct sk_buff *skb;			// message being filled, NULL when empty
+  void *hdr;					// its generic netlink header
+  struct nlattr *events;		// TM_A_EVENTS, grows with every event
+  struct tasklet_hrtimer timer;	// flushes the batch after batch_timeout_us
+};
+
+static DEFINE_PER_CPU(struct tm_batch, tm_batches);
+
+/*
+ * Send the batched events, called with the
+ * bottom halves disabled.
+ */
+static void flush_batch(struct tm_batch *batch)
+{
+  struct sk_buff *skb = batch->skb;
+  int res;
+
+  if (skb == NULL)
     return;
+
+  batch->skb = NULL;
+  batch->events->nla_len = skb_tail_pointer(skb) - (unsigned char *) batch->events;
+  genlmsg_end(skb, batch->hdr);
+
+  // -ESRCH only means the readers have gone away
+  res = genlmsg_multicast(skb, 0, tm_events_group.id, GFP_ATOMIC);
+  if(res<0 && res != -ESRCH) {
+    tm_stat_inc(TM_STAT_NETLINK_FAILURES);
+    printk(KERN_ERR "TCP packet: Error while sending back to user.\n");
   }
-  
-  if(gotPID)
-  {   
-    // To send the message back to user space application
-    struct nlmsghdr *nlh = NULL;
-    struct skb_buff *skb_out;
-    int msg_size;
-
-    struct timeval tv;
-    //    struct tm *tm;
-    do_gettimeofday(&tv);
- 
-    char temp[30];
-    char temp2[10];
-    char temp3[10];
-    char temp4[10];
-    char temp5[10];
-    
-    char msg[MAX_PAYLOAD];
-      
-    // The message should be in such format:
-    // eventType,packetInterval,newConnection,direction,connection_id,packetsize
-    // eventType: integer, and 2 means it is a new packet event.
-    // packetInterval: unsigned long indicating the packet interval since last burst packet in microseconds.
-    // newConnection: integer. 1 means this is a new connection, and 0 means this is an already existing connection.
-    // direction: integer. 0 means uplink, 1 means downlink.
-    // connection_id: unsigned integer.
-    // packetsize: unsigned integer
-    
+}
 
-    sprintf(msg, "%d", 2);
-    strcat(msg, ",");
+static enum hrtimer_restart batch_timer_function(struct hrtimer *timer)
+{
+  struct tm_batch *batch = container_of(timer, struct tm_batch, timer.timer);
 
-    unsigned long timeCurrent = tv.tv_sec*1000000+tv.tv_usec;
-    
-    struct constate *connection = get_connection(&all_connections_head, connection_id);
-    unsigned long packetInterval = timeCurrent-connection->timeStamp;
-    connection->timeStamp = timeCurrent;
+  flush_batch(batch);
+  return HRTIMER_NORESTART;
+}
 
-    sprintf(temp, "%u", packetInterval);
-    strcat(msg, temp);
-    
-    strcat(msg, ",");
-    
-    if(newConnection)
-    {
-      strcat(msg, "1");
+/*
+ * Reserve room for one event in the batch of the
+ * current CPU. Starts a new message, beginning with a
+ * clock record, and its flush timer if the batch was
+ * empty.
+ */
+static struct tm_event * batch_add_event(struct tm_batch *batch)
+{
+  unsigned int size = clamp_t(unsigned int, batch_bytes, 2 * sizeof(struct tm_event), BATCH_MAX_BYTES);
+
+  if (batch->skb == NULL) {
+    batch->skb = genlmsg_new(nla_total_size(size), GFP_ATOMIC);
+    if (batch->skb == NULL) {
+      printk(KERN_ERR "TM: Failed to allocate new skb");
+      return NULL;
     }
-    
-    else
-    {
-      strcat(msg, "0");
+
+    batch->hdr = genlmsg_put(batch->skb, 0, 0, &tm_genl_family, 0, TM_CMD_EVENTS);
+    batch->events = nla_reserve(batch->skb, TM_A_EVENTS, 0);
+    fill_clock_event((struct tm_event *) skb_put(batch->skb, sizeof(struct tm_event)));
+
+    if (batch_bytes > 0)
+      tasklet_hrtimer_start(&batch->timer, ktime_set(0, batch_timeout_us * NSEC_PER_USEC),
+                            HRTIMER_MODE_REL_PINNED);
+  }
+
+  return (struct tm_event *) skb_put(batch->skb, sizeof(struct tm_event));
+}
+
+/*
+ * Is there room for another event in the batch?
+ */
+static inline bool batch_full(struct tm_batch *batch)
+{
+  unsigned int len = skb_tail_pointer(batch->skb) - (unsigned char *) nla_data(batch->events);
+
+  return len + sizeof(struct tm_event) > min_t(unsigned int, batch_bytes, BATCH_MAX_BYTES)
+    || skb_tailroom(batch->skb) < sizeof(struct tm_event);
+}
+
+static void init_batches(void)
+{
+  int cpu;
+
+  for_each_possible_cpu(cpu) {
+    struct tm_batch *batch = &per_cpu(tm_batches, cpu);
+
+    batch->skb = NULL;
+    tasklet_hrtimer_init(&batch->timer, batch_timer_function, CLOCK_MONOTONIC, HRTIMER_MODE_REL_PINNED);
+  }
+}
+
+/*
+ * Called on module exit, after the hooks have been
+ * unregistered. Sends whatever is left.
+ */
+static void flush_batches(void)
+{
+  int cpu;
+
+  for_each_possible_cpu(cpu) {
+    struct tm_batch *batch = &per_cpu(tm_batches, cpu);
+
+    tasklet_hrtimer_cancel(&batch->timer);
+    local_bh_disable();
+    flush_batch(batch);
+    local_bh_enable();
+  }
+}
+
+
+/*
+ * Reserve and commit an event on the current CPU, in
+ * its ring in the ring capture mode and in its event
+ * queue otherwise. Called with the bottom halves
+ * disabled.
+ */
+static inline struct tm_event * reserve_event(void)
+{
+  if (ring_capture())
+    return ring_reserve(&__get_cpu_var(tm_rings));
+  return event_queue_reserve(&__get_cpu_var(tm_event_queues));
+}
+
+static inline void commit_event(void)
+{
+  if (ring_capture())
+    ring_commit(&__get_cpu_var(tm_rings));
+  else
+    event_queue_commit(&__get_cpu_var(tm_event_queues));
+}
+
+static inline void fill_packet_event(struct tm_event *event, struct constate *connection,
+                                     u64 now, const struct tm_packet *packet,
+                                     int direction, bool newConnection)
+{
+  memset(event, 0, sizeof(*event));
+  event->version = TM_EVENT_VERSION;
+  event->type = TM_EVENT_PACKET;
+  event->direction = direction;
+  event->flags = newConnection ? TM_EVENT_F_NEW_CONNECTION : 0;
+  event->timestamp = now;
+  event->interval = now - connection->timeStamp;
+  event->connection_id = connection->connection_id;
+  event->size = packet->payload;
+  event->segments = packet->segments;
+  event->segment_size = packet->segment_size;
+  event->uid = connection->uid;
+  event->pid = connection->pid;
+}
+
+/**
+ * Send the queued events of one CPU
+ *
+ * The work item of an event queue (see eventqueue.h).
+ * Moves the events into the netlink batch of the CPU it
+ * runs on, sending every batch that fills up.
+ */
+static void send_queued_events(struct work_struct *work)
+{
+  struct tm_event_queue *queue = container_of(work, struct tm_event_queue, work);
+  struct tm_event *queued;
+
+  while ((queued = event_queue_peek(queue)) != NULL) {
+    struct tm_batch *batch;
+    struct tm_event *event;
+
+    local_bh_disable();
+    batch = &__get_cpu_var(tm_batches);
+
+    event = batch_add_event(batch);
+    if (event != NULL) {
+      memcpy(event, queued, sizeof(struct tm_event));
+
+      if (batch_full(batch)) {
+        /*
+         * Can not wait for the timer tasklet here, if it
+         * is already pending it just finds an empty or a
+         * newer batch
+         */
+        hrtimer_try_to_cancel(&batch->timer.timer);
+        flush_batch(batch);
+      }
+    } else {
+      tm_stat_inc(TM_STAT_EVENTS_DROPPED);
     }
-    strcat(msg, ",");
-    sprintf(temp3, "%d", direction);
-    strcat(msg, temp3);
-    strcat(msg, ",");
-    sprintf(temp4, "%u", connection_id);
-    strcat(msg, temp4);
-    strcat(msg, ",");    sprintf(temp5, "%d", size);
-    strcat(msg, temp5);
-    int res;
-    msg_size=strlen(msg);
-    skb_out = nlmsg_new(msg_size,0);
-    
-    if(!skb_out)
-    {
-      printk(KERN_ERR "TM: Failed to allocate new skb");
-      return;
-    } 
-    nlh=nlmsg_put(skb_out,0,0,NLMSG_DONE,msg_size,0);
-    strncpy(nlmsg_data(nlh),msg,msg_size);
-    res=nlmsg_unicast(nl_sk,skb_out,pid);
-
-    printk(KERN_INFO "TCP packet: Msg to be sent: %s.\n", msg);
-    if(res<0)
-      printk(KERN_ERR "TCP packet: Error while sending back to user.\n\n");
-    else
-      printk(KERN_INFO "TCP packet: Sending new packet message successfully. Msg: %s.\n\n", msg);    
+
+    local_bh_enable();
+    event_queue_pop(queue);
   }
 }
 
+/*
+ * Send a burst of 'connection', or of the whole device
+ * if it is NULL. Called with the bottom halves disabled.
+ */
+static void send_burst(const struct tm_burst *burst, struct constate *connection)
+{
+  struct tm_event *event = reserve_event();
+
+  if (event != NULL) {
+    if (connection != NULL)
+      fill_burst_event(event, burst, connection->connection_id,
+                       connection->uid, connection->pid, 0);
+    else
+      fill_burst_event(event, burst, 0, TM_UID_UNKNOWN, TM_PID_UNKNOWN, TM_EVENT_F_DEVICE);
+    commit_event();
+  }
 
-static void netlink_create()
+  tm_stat_inc(event != NULL ? TM_STAT_EVENTS_EMITTED : TM_STAT_EVENTS_DROPPED);
+}
+
+/*
+ * The part of the device burst seen by one CPU, see
+ * bursts.h. The lock is only taken by that CPU and by
+ * the flush work.
+ */
+struct tm_cpu_burst {
+  spinlock_t lock;
+  struct tm_burst burst;				// packets of this CPU
+  struct tm_burst parts[BURST_PARTS];	// ended, in time order
+  unsigned int nr_parts;
+};
+
+static DEFINE_PER_CPU(struct tm_cpu_burst, tm_cpu_bursts);
+
+/*
+ * Parts of all CPUs, only used by the flush work.
+ * device_burst is the device burst that may still grow
+ * and device_burst_end the end of the last one sent.
+ */
+static struct tm_burst *device_parts = NULL;
+static struct tm_burst device_burst;
+static u64 device_burst_end = 0;
+
+/*
+ * Queue an ended part. If the flush work is late the
+ * part is added to the last one, joining two bursts of
+ * this CPU.
+ */
+static inline void add_burst_part(struct tm_cpu_burst *cpu_burst, const struct tm_burst *part)
 {
-   nl_sk = netlink_kernel_create(&init_net, NETLINK_TRAFFICMONITOR,0, processRequest, NULL, THIS_MODULE);
-  if (nl_sk == NULL)
-    printk(KERN_ERR "netlink: Fail in Initializing Netlink Socket");
+  if (cpu_burst->nr_parts < BURST_PARTS)
+    cpu_burst->parts[cpu_burst->nr_parts++] = *part;
   else
-    printk(KERN_INFO "Initializing Netlink Socket successfully");
+    burst_merge(&cpu_burst->parts[BURST_PARTS - 1], part);
+}
+
+/*
+ * Add a packet to the burst of its connection and to
+ * the device burst part of the current CPU, sending the
+ * connection burst it ends. Called with the bottom
+ * halves disabled.
+ */
+static void add_burst_packet(struct constate *connection, const struct tm_packet *packet,
+                             int direction, u64 now)
+{
+  struct tm_cpu_burst *cpu_burst = &__get_cpu_var(tm_cpu_bursts);
+  struct tm_burst done;
+  bool ended;
+
+  spin_lock(&connection->cold->burst_lock);
+  ended = burst_add(&connection->cold->burst, &done, now, packet->payload, packet->segments, direction);
+  spin_unlock(&connection->cold->burst_lock);
+  if (ended)
+    send_burst(&done, connection);
+
+  spin_lock(&cpu_burst->lock);
+  if (burst_add(&cpu_burst->burst, &done, now, packet->payload, packet->segments, direction))
+    add_burst_part(cpu_burst, &done);
+  spin_unlock(&cpu_burst->lock);
+}
+
+static int compare_burst_start(const void *a, const void *b)
+{
+  const struct tm_burst *x = a, *y = b;
+
+  if (x->start == y->start)
+    return 0;
+  return x->start < y->start ? -1 : 1;
+}
+
+static void send_device_burst(void)
+{
+  device_burst.gap = device_burst_end && device_burst.start > device_burst_end ?
+    device_burst.start - device_burst_end : 0;
+  device_burst_end = device_burst.end;
+
+  local_bh_disable();
+  send_burst(&device_burst, NULL);
+  local_bh_enable();
+
+  init_burst(&device_burst);
+}
+
+/*
+ * Take the ended parts of all CPUs and send the device
+ * bursts they make up that have ended by 'now'. The
+ * part still open on a CPU is not taken, but it joins
+ * everything from burst_gap_us before its start on, as
+ * it has had a packet within burst_gap_us of 'now'. So
+ * only the last device burst can be unfinished, it is
+ * kept in device_burst for the next flush.
+ */
+static void send_device_bursts(u64 now)
+{
+  u64 gap = (u64) burst_gap_us * NSEC_PER_USEC;
+  u64 open_start = ULLONG_MAX;
+  unsigned int nr_parts = 0;
+  unsigned int i;
+  int cpu;
+
+  for_each_possible_cpu(cpu) {
+    struct tm_cpu_burst *cpu_burst = &per_cpu(tm_cpu_bursts, cpu);
+    struct tm_burst done;
+
+    spin_lock_bh(&cpu_burst->lock);
+    memcpy(&device_parts[nr_parts], cpu_burst->parts, cpu_burst->nr_parts * sizeof(struct tm_burst));
+    nr_parts += cpu_burst->nr_parts;
+    cpu_burst->nr_parts = 0;
+
+    if (take_burst(&cpu_burst->burst, &done, now))
+      device_parts[nr_parts++] = done;
+    else if (burst_open(&cpu_burst->burst))
+      open_start = min(open_start, cpu_burst->burst.start);
+    spin_unlock_bh(&cpu_burst->lock);
+  }
+
+  sort(device_parts, nr_parts, sizeof(struct tm_burst), compare_burst_start, NULL);
+
+  for (i = 0; i < nr_parts; i++) {
+    if (burst_open(&device_burst) && !burst_joins(&device_burst, &device_parts[i])
+        && device_burst.end + gap < open_start)
+      send_device_burst();
+    burst_merge(&device_burst, &device_parts[i]);
+  }
+
+  if (burst_ended(&device_burst, now) && device_burst.end + gap < open_start)
+    send_device_burst();
+}
+
+static int init_device_bursts(void)
+{
+  int cpu;
+
+  for_each_possible_cpu(cpu)
+    spin_lock_init(&per_cpu(tm_cpu_bursts, cpu).lock);
+
+  init_burst(&device_burst);
+  device_parts = kcalloc(num_possible_cpus() * (BURST_PARTS + 1), sizeof(struct tm_burst),
+                         GFP_KERNEL);
+  return device_parts != NULL ? 0 : -ENOMEM;
 }
 
+static void destroy_device_bursts(void)
+{
+  kfree(device_parts);
+}
+
+/*
+ * Send the bursts that have ended by 'now' without a
+ * packet to end them.
+ */
+static void send_ended_bursts(u64 now)
+{
+  struct constate_hash *hash;
+  struct constate *node;
+  struct hlist_node *pos;
+  unsigned int bucket;
+  struct tm_burst done;
+  bool ended;
+
+  rcu_read_lock();
+  hash = rcu_dereference(all_connections.hash);
+  for_each_connection_rcu(hash, node, bucket, pos) {
+    spin_lock_bh(&node->cold->burst_lock);
+    ended = take_burst(&node->cold->burst, &done, now);
+    spin_unlock_bh(&node->cold->burst_lock);
+
+    if (ended) {
+      local_bh_disable();
+      send_burst(&done, node);
+      local_bh_enable();
+    }
+  }
+  rcu_read_unlock();
+
+  send_device_bursts(now);
+}
+
+static void flush_bursts(struct work_struct *work);
+static DECLARE_DELAYED_WORK(burst_work, flush_bursts);
+
+static void flush_bursts(struct work_struct *work)
+{
+  if (burst_summary && (ring_capture() || tm_listening()))
+    send_ended_bursts(tm_now());
+
+  schedule_delayed_work(&burst_work, msecs_to_jiffies(BURST_FLUSH_MS));
+}
+
+/**
+ * Send a packet event to the user space
+ *
+ * The event is a struct tm_event (see events.h)
+ * written into the ring of the current CPU in the ring
+ * capture mode, and otherwise into the event queue of
+ * the current CPU, from where send_queued_events()
+ * sends it over netlink. Either way nothing here waits
+ * for the reader. 'now' is the time the hook read for
+ * the packet, see clock.h.
+ *
+ * With burst_summary on the packet is only added to
+ * its bursts, see bursts.h.
+ */
+void newPacket(struct constate *connection, const struct tm_packet *packet, int direction,
+               bool newConnection, u64 now)
+{
+  struct tm_event *event;
+
+  if( direction>1 || direction<0 )
+  {
+    printk(KERN_ERR "TM: packet direction error\n");
+    return;
+  }
+  
+  if(!ring_capture() && !tm_listening())
+    return;
+
+  local_bh_disable();
+
+  if (burst_summary) {
+    add_burst_packet(connection, packet, direction, now);
+  } else {
+    event = reserve_event();
+    if (event != NULL) {
+      fill_packet_event(event, connection, now, packet, direction, newConnection);
+      commit_event();
+    }
+
+    tm_stat_inc(event != NULL ? TM_STAT_EVENTS_EMITTED : TM_STAT_EVENTS_DROPPED);
+  }
+
+  local_bh_enable();
+
+  connection->timeStamp = now;
+}
 
 
 /**
@@ -216,15 +836,43 @@ static int __init ec_module_init(void)
 {
   printk(KERN_INFO "TM :: MODULE INITIALIZATION, timestamp %llu\n", gettime());
 
-  printk(KERN_INFO "netlink: Initializing Netlink Socket\n");
-  netlink_create();
+  printk(KERN_INFO "netlink: Registering generic netlink family %s\n", TM_GENL_NAME);
+  if (register_genl_family() != 0) {
+    printk(KERN_ERR "netlink: Could not register generic netlink family\n");
+    return -EBUSY;
+  }
     
   /**
    * Connection Tracking
    */
 
-  all_connections_head=NULL;
-  spin_lock_init( &all_connections_spinlock);
+  if (init_connections(&all_connections) != 0) {
+    printk(KERN_ERR "TM :: Could not allocate the connection table\n");
+    genl_unregister_family(&tm_genl_family);
+    return -ENOMEM;
+  }
+
+  init_batches();
+
+  debugfs_root = debugfs_create_dir("trafficmonitor", NULL);
+  if (init_rings(debugfs_root) != 0 || init_event_queues(debugfs_root, send_queued_events) != 0
+      || init_device_bursts() != 0) {
+    printk(KERN_ERR "TM :: Could not allocate the event rings, queues or bursts\n");
+    destroy_device_bursts();
+    destroy_event_queues(send_queued_events);
+    destroy_rings();
+    debugfs_remove_recursive(debugfs_root);
+    delete_all(&all_connections);
+    genl_unregister_family(&tm_genl_family);
+    return -ENOMEM;
+  }
+
+  init_filter(debugfs_root);
+  init_choke(debugfs_root, restore_unchoked_connections);
+  init_connection_view(debugfs_root);
+  init_stats(debugfs_root);
+  init_latency(debugfs_root);
+  schedule_delayed_work(&burst_work, msecs_to_jiffies(BURST_FLUSH_MS));
 
 
   /**
@@ -249,8 +897,22 @@ static int __exit ec_module_exit(void)
 
   nf_unregister_hook(&hook_local_out_ops);
   nf_unregister_hook(&hook_local_in_ops);
-  delete_all(&all_connections_head);
-  sock_release(nl_sk->sk_socket);
+  stop_choke();
+  cancel_delayed_work_sync(&burst_work);
+  if (burst_summary)
+    send_ended_bursts(ULLONG_MAX);	// whatever is open has ended
+  destroy_device_bursts();
+  destroy_connection_view();
+  destroy_stats();
+  destroy_latency();
+  delete_all(&all_connections);
+  destroy_event_queues(send_queued_events);
+  flush_batches();
+  genl_unregister_family(&tm_genl_family);
+  destroy_filter();
+  destroy_choke();
+  destroy_rings();
+  debugfs_remove_recursive(debugfs_root);
   printk(KERN_INFO "TM :: MODULE DISABLED \n");
   return 0;
 }
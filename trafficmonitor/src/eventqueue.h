@@ -0,0 +1,201 @@
+/* 
+ * This file is part of TrafficMonitor.
+ * 
+ * Copyright (C) 2011, Ahmad Nazir, Mohammad Hoque, Wei Li and Aki Saarinen.
+ * 
+ * TrafficMonitor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * TrafficMonitor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with TrafficMonitor.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef EVENTQUEUE_H_
+#define EVENTQUEUE_H_
+
+#include <linux/debugfs.h>
+#include <linux/log2.h>
+#include <linux/moduleparam.h>
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+
+#include "events.h"
+
+/**
+ * Event Queue
+ *
+ * The hooks must not wait for the user space, so they
+ * only copy the event into a queue of the current CPU
+ * and schedule a work item on that CPU. The work item
+ * drains the queue into the netlink batches and sends
+ * them, in process context.
+ *
+ * A queue has a single producer, the hooks on its own
+ * CPU with the bottom halves disabled, and a single
+ * consumer, its work item, so it needs no lock: the
+ * producer only moves head and the consumer only moves
+ * tail. Both run freely and are masked when used as an
+ * index, hence the length is a power of two. An event
+ * that does not fit is dropped and counted.
+ *
+ * The depth and drops of each queue are shown in
+ * /sys/kernel/debug/trafficmonitor/event_queue.
+ */
+static unsigned int event_queue_len = 1024;
+module_param(event_queue_len, uint, 0444);
+MODULE_PARM_DESC(event_queue_len, "Events queued per CPU before they are dropped, rounded up to a power of two");
+
+struct tm_event_queue {
+  struct tm_event *slots;
+  unsigned int mask;		// length - 1
+  unsigned int head;		// next slot the producer writes
+  unsigned int tail;		// next slot the consumer reads
+  unsigned long dropped;
+  struct work_struct work;	// the consumer
+};
+
+static DEFINE_PER_CPU(struct tm_event_queue, tm_event_queues);
+static struct dentry *event_queue_file = NULL;
+
+static inline unsigned int event_queue_depth(struct tm_event_queue *queue)
+{
+  return ACCESS_ONCE(queue->head) - ACCESS_ONCE(queue->tail);
+}
+
+/*
+ * Producer side, called with the bottom halves
+ * disabled. Returns the slot to fill in, or NULL if
+ * the queue is full. The event is handed over to the
+ * consumer by event_queue_commit().
+ */
+static inline struct tm_event * event_queue_reserve(struct tm_event_queue *queue)
+{
+  if (queue->head - ACCESS_ONCE(queue->tail) > queue->mask) {
+    queue->dropped++;
+    return NULL;
+  }
+
+  smp_mb();			// the consumer is done with the slot
+  return &queue->slots[queue->head & queue->mask];
+}
+
+static inline void event_queue_commit(struct tm_event_queue *queue)
+{
+  smp_wmb();		// the slot is written before head moves
+  queue->head++;
+  schedule_work_on(smp_processor_id(), &queue->work);
+}
+
+/*
+ * Consumer side. Returns the oldest event, or NULL if
+ * the queue is empty. The slot is given back to the
+ * producer by event_queue_pop().
+ */
+static inline struct tm_event * event_queue_peek(struct tm_event_queue *queue)
+{
+  if (queue->tail == ACCESS_ONCE(queue->head))
+    return NULL;
+
+  smp_rmb();		// read the slot only after seeing head
+  return &queue->slots[queue->tail & queue->mask];
+}
+
+static inline void event_queue_pop(struct tm_event_queue *queue)
+{
+  smp_mb();			// done with the slot before giving it back
+  queue->tail++;
+}
+
+static int event_queue_show(struct seq_file *m, void *v)
+{
+  unsigned long dropped = 0;
+  int cpu;
+
+  seq_printf(m, "cpu\tdepth\tdropped\n");
+
+  for_each_possible_cpu(cpu) {
+    struct tm_event_queue *queue = &per_cpu(tm_event_queues, cpu);
+
+    seq_printf(m, "%d\t%u\t%lu\n", cpu, event_queue_depth(queue), queue->dropped);
+    dropped += queue->dropped;
+  }
+
+  seq_printf(m, "length %u, dropped %lu\n", event_queue_len, dropped);
+  return 0;
+}
+
+static int event_queue_open(struct inode *inode, struct file *file)
+{
+  return single_open(file, event_queue_show, NULL);
+}
+
+static const struct file_operations event_queue_fops = {
+  .owner = THIS_MODULE,
+  .open = event_queue_open,
+  .read = seq_read,
+  .llseek = seq_lseek,
+  .release = single_release,
+};
+
+/*
+ * Stop the consumers and free the queues. Whatever is
+ * left in a queue is handed to 'drain' first, so the
+ * producers must be gone already.
+ */
+static void destroy_event_queues(work_func_t drain)
+{
+  int cpu;
+
+  debugfs_remove(event_queue_file);
+  event_queue_file = NULL;
+
+  for_each_possible_cpu(cpu) {
+    struct tm_event_queue *queue = &per_cpu(tm_event_queues, cpu);
+
+    if (queue->slots == NULL)
+      continue;
+
+    cancel_work_sync(&queue->work);
+    drain(&queue->work);
+
+    kfree(queue->slots);
+    queue->slots = NULL;
+  }
+}
+
+static int init_event_queues(struct dentry *parent, work_func_t drain)
+{
+  int cpu;
+
+  event_queue_len = roundup_pow_of_two(max_t(unsigned int, event_queue_len, 2));
+
+  for_each_possible_cpu(cpu) {
+    struct tm_event_queue *queue = &per_cpu(tm_event_queues, cpu);
+
+    queue->slots = kcalloc(event_queue_len, sizeof(struct tm_event), GFP_KERNEL);
+    if (queue->slots == NULL) {
+      destroy_event_queues(drain);
+      return -ENOMEM;
+    }
+
+    queue->mask = event_queue_len - 1;
+    queue->head = 0;
+    queue->tail = 0;
+    queue->dropped = 0;
+    INIT_WORK(&queue->work, drain);
+  }
+
+  event_queue_file = debugfs_create_file("event_queue", 0444, parent, NULL, &event_queue_fops);
+  return 0;
+}
+
+#endif /* EVENTQUEUE_H_ */
@@ -0,0 +1,287 @@
+/* 
+ * This file is part of TrafficMonitor.
+ * 
+ * Copyright (C) 2011, Ahmad Nazir, Mohammad Hoque, Wei Li and Aki Saarinen.
+ * 
+ * TrafficMonitor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * TrafficMonitor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with TrafficMonitor.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef EVENTS_H_
+#define EVENTS_H_
+
+/**
+ * Events sent to the user space
+ *
+ * This header is shared by the module and the user
+ * space programs reading the events, so it must only
+ * use types that are available in both.
+ *
+ * Every event is a fixed size, packed struct tm_event
+ * written directly into a netlink attribute. One
+ * netlink message carries a batch of one or more
+ * events back to back. All
+ * fields are in host byte order, the reader runs on
+ * the same device as the module. 'version' is bumped
+ * whenever the layout changes so that a reader can
+ * refuse records it does not understand.
+ *
+ * Time is kept in nanoseconds of the monotonic clock,
+ * read once per packet in the hooks. It does not jump
+ * when the wall clock is set and does not wrap. To
+ * align the events with other logs every netlink batch,
+ * and every ring when it is created, starts with a
+ * TM_EVENT_CLOCK record that gives the monotonic time
+ * and the wall clock time of the same moment.
+ */
+#include <linux/types.h>
+#ifndef __KERNEL__
+#include <stdio.h>
+#include <string.h>
+#endif
+
+#define TM_EVENT_VERSION 5
+
+/*
+ * Event types. 2 is kept for packets, as in the
+ * old text messages.
+ */
+#define TM_EVENT_CLOCK 1	// wall clock anchor, only timestamp and wall_clock are set
+#define TM_EVENT_PACKET 2
+#define TM_EVENT_BURST 3	// summary of a burst, see bursts.h
+
+/*
+ * Event flags
+ */
+#define TM_EVENT_F_NEW_CONNECTION 0x01	// first burst packet of the connection
+#define TM_EVENT_F_DEVICE 0x02			// burst of the whole device, connection_id is 0
+
+/*
+ * Owner of a connection that is not known (yet)
+ */
+#define TM_EVENT_UID_UNKNOWN ((__u32) -1)
+#define TM_EVENT_PID_UNKNOWN 0
+
+struct tm_event {
+  __u64 timestamp;		// nanoseconds of the monotonic clock, burst: first packet
+  union {
+    __u64 interval;		// packet: nanoseconds since the previous burst packet of the connection
+    __u64 wall_clock;	// clock: nanoseconds since the epoch at 'timestamp'
+    __u64 gap;			// burst: nanoseconds since the end of the previous burst, 0 for the first
+  };
+  __u32 connection_id;	// local port of the connection
+  __u32 size;			// TCP payload in bytes, burst: in both directions
+  __u32 uid;			// owner of the local socket or TM_EVENT_UID_UNKNOWN
+  __u32 pid;			// process of the local socket or TM_EVENT_PID_UNKNOWN
+  __u16 segments;		// packet: segments on the wire, more than 1 for GSO and GRO
+  __u16 segment_size;	// packet: payload of a full segment for GSO and GRO, else 0
+  __u8 version;			// TM_EVENT_VERSION
+  __u8 type;			// TM_EVENT_*
+  __u8 direction;		// 0 means uplink, 1 means downlink
+  __u8 flags;			// TM_EVENT_F_*
+  struct {
+    __u64 end;			// last packet
+    __u32 bytes[2];		// TCP payload by direction
+    __u32 packets[2];	// segments on the wire by direction
+  } burst;				// only set in TM_EVENT_BURST
+} __attribute__((packed));
+
+/**
+ * Generic netlink interface
+ *
+ * The module registers the generic netlink family
+ * TM_GENL_NAME. A reader resolves the id of the family
+ * and of its multicast groups through the "nlctrl"
+ * family and joins the groups it wants, any number of
+ * readers can listen at the same time:
+ *
+ * TM_GENL_GROUP_EVENTS gets TM_CMD_EVENTS messages, the
+ * TM_A_EVENTS attribute holding a batch of tm_events.
+ *
+ * TM_GENL_GROUP_CONTROL gets a TM_CMD_CHOKE message
+ * with TM_A_CHOKE whenever the choke state is set.
+ *
+ * Requests to the module:
+ * TM_CMD_SET_CHOKE with TM_A_CHOKE 1 sets the receive
+ * windows to zero and 0 restores them (needs
+ * CAP_NET_ADMIN). TM_CMD_GET_CHOKE is answered with a
+ * TM_CMD_CHOKE message.
+ *
+ * TM_CMD_ADD_FILTER appends a rule to the event filter
+ * and TM_CMD_CLEAR_FILTER removes every rule (both need
+ * CAP_NET_ADMIN). A rule has the TM_A_FILTER_*
+ * attributes, a missing one matches everything; the
+ * first rule matching a packet decides whether it is
+ * captured. TM_A_FILTER_ACTION of TM_CMD_CLEAR_FILTER
+ * sets what happens to the packets no rule matches,
+ * TM_FILTER_INCLUDE if missing.
+ *
+ * TM_CMD_ADD_CHOKE chokes only the connections matching
+ * the port and uid TM_A_FILTER_* attributes, for
+ * TM_A_CHOKE_TIMEOUT milliseconds or until released if
+ * that is missing or 0. TM_CMD_RELEASE_CHOKE releases
+ * the policies with the same attributes, or all of them
+ * if there are none (both need CAP_NET_ADMIN).
+ */
+#define TM_GENL_NAME "TRAFFICMON"
+#define TM_GENL_VERSION 1
+#define TM_GENL_GROUP_EVENTS "events"
+#define TM_GENL_GROUP_CONTROL "control"
+
+enum {
+  TM_CMD_UNSPEC,
+  TM_CMD_EVENTS,		// events to the readers
+  TM_CMD_SET_CHOKE,		// request
+  TM_CMD_GET_CHOKE,		// request
+  TM_CMD_CHOKE,			// choke state to the readers
+  TM_CMD_ADD_FILTER,	// request
+  TM_CMD_CLEAR_FILTER,	// request
+  TM_CMD_ADD_CHOKE,		// request
+  TM_CMD_RELEASE_CHOKE,	// request
+  __TM_CMD_MAX,
+};
+#define TM_CMD_MAX (__TM_CMD_MAX - 1)
+
+enum {
+  TM_A_UNSPEC,
+  TM_A_EVENTS,			// binary, struct tm_event records back to back
+  TM_A_CHOKE,			// u8, 1 when the windows are set to zero
+  TM_A_FILTER_ACTION,	// u8, TM_FILTER_INCLUDE or TM_FILTER_EXCLUDE
+  TM_A_FILTER_DIRECTIONS,	// u8, TM_FILTER_UPLINK and/or TM_FILTER_DOWNLINK
+  TM_A_FILTER_LOCAL_PORT_MIN,	// u16, ranges are inclusive
+  TM_A_FILTER_LOCAL_PORT_MAX,	// u16
+  TM_A_FILTER_REMOTE_PORT_MIN,	// u16
+  TM_A_FILTER_REMOTE_PORT_MAX,	// u16
+  TM_A_FILTER_UID,		// u32, owner of the local socket
+  TM_A_FILTER_MIN_PAYLOAD,	// u32, TCP payload in bytes
+  TM_A_FILTER_MAX_PAYLOAD,	// u32
+  TM_A_CHOKE_TIMEOUT,	// u32, milliseconds
+  __TM_A_MAX,
+};
+#define TM_A_MAX (__TM_A_MAX - 1)
+
+#define TM_FILTER_INCLUDE 1
+#define TM_FILTER_EXCLUDE 2
+
+#define TM_FILTER_UPLINK 0x01
+#define TM_FILTER_DOWNLINK 0x02
+
+/**
+ * Ring buffer
+ *
+ * In the ring capture mode (ring_pages module parameter)
+ * the events are not sent over netlink but written
+ * into a ring buffer per CPU. A reader mmaps
+ * /sys/kernel/debug/trafficmonitor/ring/cpuN, which
+ * starts with a struct tm_ring_header followed by
+ * 'size' struct tm_event slots at 'data_offset'.
+ *
+ * The module only moves 'head' and the reader only
+ * moves 'tail'; both are slot indexes in [0, size).
+ * The ring is empty when they are equal, and one slot
+ * is always left unused so that a full ring can be told
+ * apart from an empty one. Events that do not fit are
+ * counted in 'dropped'. poll() on the file waits until
+ * the ring is not empty.
+ */
+struct tm_ring_header {
+  __u32 head;			// next slot the module writes
+  __u32 tail;			// next slot the reader reads
+  __u32 size;			// number of slots
+  __u32 data_offset;	// offset of the first slot from the header
+  __u32 dropped;		// events lost because the ring was full
+  __u32 pad;
+};
+
+#ifndef __KERNEL__
+
+/**
+ * User space decoder
+ *
+ * tm_event_count() tells how many events a
+ * TM_A_EVENTS payload of 'len' bytes holds.
+ *
+ * tm_event_decode() copies the event number 'index'
+ * out of a TM_A_EVENTS payload of 'len' bytes. Returns 0
+ * on success and -1 if the payload is too short or the
+ * event has an unknown version.
+ *
+ * tm_event_format() writes a packet event in the old
+ * comma separated text format:
+ * eventType,packetInterval,newConnection,direction,connection_id,packetsize
+ * with packetInterval in microseconds, and returns
+ * what snprintf() returns. Other events have no text
+ * form and give -1.
+ *
+ * tm_event_wall_clock() turns the monotonic timestamp
+ * of an event into nanoseconds since the epoch using
+ * the latest TM_EVENT_CLOCK record 'anchor'.
+ */
+static inline size_t tm_event_count(size_t len) {
+  return len / sizeof(struct tm_event);
+}
+
+static inline int tm_event_decode(const void *payload, size_t len, size_t index, struct tm_event *event) {
+
+  if (index >= tm_event_count(len))
+    return -1;
+
+  memcpy(event, (const char *) payload + index * sizeof(struct tm_event), sizeof(struct tm_event));
+
+  if (event->version != TM_EVENT_VERSION)
+    return -1;
+
+  return 0;
+}
+
+/*
+ * tm_ring_read() copies the oldest event out of a
+ * mapped ring and frees its slot. Returns 0 on success
+ * and -1 if the ring is empty.
+ */
+static inline int tm_ring_read(volatile struct tm_ring_header *ring, struct tm_event *event) {
+  __u32 tail = ring->tail;
+
+  if (tail == ring->head)
+    return -1;
+
+  __sync_synchronize();		// read the slot only after seeing head
+  memcpy(event, (const char *) ring + ring->data_offset + tail * sizeof(struct tm_event),
+         sizeof(struct tm_event));
+  __sync_synchronize();		// done with the slot before giving it back
+
+  ring->tail = (tail + 1 == ring->size) ? 0 : tail + 1;
+  return 0;
+}
+
+static inline int tm_event_format(char *buf, size_t len, const struct tm_event *event) {
+
+  if (event->type != TM_EVENT_PACKET)
+    return -1;
+
+  return snprintf(buf, len, "%u,%u,%u,%u,%u,%u",
+                  event->type,
+                  (unsigned int) (event->interval / 1000),
+                  (event->flags & TM_EVENT_F_NEW_CONNECTION) ? 1 : 0,
+                  event->direction,
+                  event->connection_id,
+                  event->size);
+}
+
+static inline __u64 tm_event_wall_clock(const struct tm_event *event, const struct tm_event *anchor) {
+  return anchor->wall_clock + (event->timestamp - anchor->timestamp);
+}
+
+#endif /* __KERNEL__ */
+
+#endif /* EVENTS_H_ */
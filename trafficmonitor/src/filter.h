@@ -0,0 +1,280 @@
+/* 
+ * This file is part of TrafficMonitor.
+ * 
+ * Copyright (C) 2011, Ahmad Nazir, Mohammad Hoque, Wei Li and Aki Saarinen.
+ * 
+ * TrafficMonitor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * TrafficMonitor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with TrafficMonitor.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FILTER_H_
+#define FILTER_H_
+
+#include <linux/debugfs.h>
+#include <linux/rcupdate.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+
+#include "events.h"
+#include "flowkey.h"
+
+/**
+ * Event Filter
+ *
+ * Decides in the hooks whether the events of a packet
+ * are captured at all, so that uninteresting traffic
+ * such as the adb connection costs nothing further. The
+ * filter is a list of rules set from the user space
+ * over generic netlink (TM_CMD_ADD_FILTER and
+ * TM_CMD_CLEAR_FILTER, see events.h). The first rule
+ * that matches the packet decides, and when none does
+ * the default action of the filter decides.
+ *
+ * A rule matches when every one of its conditions
+ * does: the direction, the local and remote port
+ * ranges, the owner of the local socket and the TCP
+ * payload range. The owner is only known once the
+ * connection has sent a packet, until then rules with a
+ * uid do not match.
+ *
+ * The filter is replaced as a whole and read under
+ * RCU, the hooks take no lock. The writers are the
+ * generic netlink commands, which the netlink core
+ * already serializes. No filter means that everything
+ * is captured.
+ */
+#define TM_FILTER_MAX_RULES 64
+
+#define TM_UID_ANY ((uid_t) -1)
+
+struct tm_filter_rule {
+  u_int8_t action;				// TM_FILTER_INCLUDE or TM_FILTER_EXCLUDE
+  u_int8_t directions;			// TM_FILTER_UPLINK and/or TM_FILTER_DOWNLINK
+  u_int16_t local_port_min;		// host byte order, inclusive
+  u_int16_t local_port_max;
+  u_int16_t remote_port_min;
+  u_int16_t remote_port_max;
+  uid_t uid;					// TM_UID_ANY matches every owner
+  u_int32_t min_payload;		// in bytes, inclusive
+  u_int32_t max_payload;
+};
+
+struct tm_filter {
+  struct rcu_head rcu;
+  u_int8_t default_action;
+  unsigned int count;
+  struct tm_filter_rule rules[0];
+};
+
+static struct tm_filter *tm_filter = NULL;
+static struct dentry *filter_file = NULL;
+
+/*
+ * A rule matching every packet, the caller fills in
+ * what it wants to restrict.
+ */
+static inline void init_filter_rule(struct tm_filter_rule *rule, u_int8_t action)
+{
+  rule->action = action;
+  rule->directions = TM_FILTER_UPLINK | TM_FILTER_DOWNLINK;
+  rule->local_port_min = 0;
+  rule->local_port_max = 0xffff;
+  rule->remote_port_min = 0;
+  rule->remote_port_max = 0xffff;
+  rule->uid = TM_UID_ANY;
+  rule->min_payload = 0;
+  rule->max_payload = 0xffffffff;
+}
+
+static inline bool filter_rule_matches(const struct tm_filter_rule *rule, u_int8_t direction,
+                                       u_int16_t local_port, u_int16_t remote_port,
+                                       u_int32_t payload, uid_t uid)
+{
+  return (rule->directions & direction)
+    && local_port >= rule->local_port_min && local_port <= rule->local_port_max
+    && remote_port >= rule->remote_port_min && remote_port <= rule->remote_port_max
+    && (rule->uid == TM_UID_ANY || rule->uid == uid)
+    && payload >= rule->min_payload && payload <= rule->max_payload;
+}
+
+/*
+ * Should the packet be captured? 'direction' is
+ * TM_FILTER_UPLINK or TM_FILTER_DOWNLINK, 'uid' the
+ * owner of the local socket or TM_UID_UNKNOWN. Called
+ * from the hooks, under rcu_read_lock().
+ */
+static inline bool capture_packet(u_int8_t direction, const struct tm_flow_key *key,
+                                  u_int32_t payload, uid_t uid)
+{
+  struct tm_filter *filter = rcu_dereference(tm_filter);
+  u_int16_t local_port, remote_port;
+  unsigned int i;
+
+  if (filter == NULL)
+    return true;
+
+  local_port = ntohs(key->local_port);
+  remote_port = ntohs(key->remote_port);
+
+  for (i = 0; i < filter->count; i++) {
+    const struct tm_filter_rule *rule = &filter->rules[i];
+
+    if (filter_rule_matches(rule, direction, local_port, remote_port, payload, uid))
+      return rule->action == TM_FILTER_INCLUDE;
+  }
+
+  return filter->default_action == TM_FILTER_INCLUDE;
+}
+
+static void free_filter_rcu(struct rcu_head *head)
+{
+  kfree(container_of(head, struct tm_filter, rcu));
+}
+
+/*
+ * Publish a new filter and free the old one once the
+ * hooks are done with it.
+ */
+static void replace_filter(struct tm_filter *filter)
+{
+  struct tm_filter *old = tm_filter;
+
+  rcu_assign_pointer(tm_filter, filter);
+  if (old != NULL)
+    call_rcu(&old->rcu, free_filter_rcu);
+}
+
+static struct tm_filter * alloc_filter(unsigned int count)
+{
+  return kmalloc(sizeof(struct tm_filter) + count * sizeof(struct tm_filter_rule), GFP_KERNEL);
+}
+
+/*
+ * Append a rule to the filter. Returns -ENOSPC when the
+ * filter is full.
+ */
+static int add_filter_rule(const struct tm_filter_rule *rule)
+{
+  struct tm_filter *old = tm_filter;
+  struct tm_filter *filter;
+  unsigned int count = old ? old->count : 0;
+
+  if (count >= TM_FILTER_MAX_RULES)
+    return -ENOSPC;
+
+  filter = alloc_filter(count + 1);
+  if (filter == NULL)
+    return -ENOMEM;
+
+  filter->default_action = old ? old->default_action : TM_FILTER_INCLUDE;
+  filter->count = count + 1;
+  if (count > 0)
+    memcpy(filter->rules, old->rules, count * sizeof(struct tm_filter_rule));
+  filter->rules[count] = *rule;
+
+  replace_filter(filter);
+  return 0;
+}
+
+/*
+ * Remove every rule and set the default action. The
+ * default of including everything needs no filter.
+ */
+static int clear_filter(u_int8_t default_action)
+{
+  struct tm_filter *filter = NULL;
+
+  if (default_action != TM_FILTER_INCLUDE) {
+    filter = alloc_filter(0);
+    if (filter == NULL)
+      return -ENOMEM;
+
+    filter->default_action = default_action;
+    filter->count = 0;
+  }
+
+  replace_filter(filter);
+  return 0;
+}
+
+static const char * filter_action_name(u_int8_t action)
+{
+  return action == TM_FILTER_INCLUDE ? "include" : "exclude";
+}
+
+static int filter_show(struct seq_file *m, void *v)
+{
+  struct tm_filter *filter;
+  unsigned int i;
+
+  rcu_read_lock();
+  filter = rcu_dereference(tm_filter);
+
+  if (filter == NULL) {
+    seq_printf(m, "default include\n");
+    rcu_read_unlock();
+    return 0;
+  }
+
+  for (i = 0; i < filter->count; i++) {
+    const struct tm_filter_rule *rule = &filter->rules[i];
+
+    seq_printf(m, "%s%s%s local %u-%u remote %u-%u payload %u-%u",
+               filter_action_name(rule->action),
+               (rule->directions & TM_FILTER_UPLINK) ? " up" : "",
+               (rule->directions & TM_FILTER_DOWNLINK) ? " down" : "",
+               rule->local_port_min, rule->local_port_max,
+               rule->remote_port_min, rule->remote_port_max,
+               rule->min_payload, rule->max_payload);
+    if (rule->uid != TM_UID_ANY)
+      seq_printf(m, " uid %u", rule->uid);
+    seq_printf(m, "\n");
+  }
+
+  seq_printf(m, "default %s\n", filter_action_name(filter->default_action));
+  rcu_read_unlock();
+  return 0;
+}
+
+static int filter_open(struct inode *inode, struct file *file)
+{
+  return single_open(file, filter_show, NULL);
+}
+
+static const struct file_operations filter_fops = {
+  .owner = THIS_MODULE,
+  .open = filter_open,
+  .read = seq_read,
+  .llseek = seq_lseek,
+  .release = single_release,
+};
+
+static void init_filter(struct dentry *parent)
+{
+  filter_file = debugfs_create_file("filter", 0444, parent, NULL, &filter_fops);
+}
+
+/*
+ * Called on module exit, once neither the hooks nor
+ * the netlink commands can run.
+ */
+static void destroy_filter(void)
+{
+  debugfs_remove(filter_file);
+  filter_file = NULL;
+
+  replace_filter(NULL);
+  rcu_barrier();
+}
+
+#endif /* FILTER_H_ */
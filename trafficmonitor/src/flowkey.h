@@ -0,0 +1,87 @@
+/* 
+ * This file is part of TrafficMonitor.
+ * 
+ * Copyright (C) 2011, Ahmad Nazir, Mohammad Hoque, Wei Li and Aki Saarinen.
+ * 
+ * TrafficMonitor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * TrafficMonitor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with TrafficMonitor.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FLOWKEY_H_
+#define FLOWKEY_H_
+
+#include <linux/ip.h>
+#include <linux/tcp.h>
+#include <linux/jhash.h>
+#include <linux/socket.h>
+#include <linux/string.h>
+#include <linux/netfilter.h>	// union nf_inet_addr
+
+/**
+ * Flow Key
+ *
+ * Identifies a connection by its local and remote
+ * address and port, seen from the phone, so that the
+ * incoming and outgoing packets of a connection map
+ * to the same key. The addresses are large enough for
+ * IPv6; for IPv4 only the first word is used and the
+ * rest stays zero.
+ *
+ * All fields are kept in network byte order. The key
+ * is always zeroed before it is filled in so that it
+ * can be hashed and compared as plain words.
+ */
+struct tm_flow_key {
+  union nf_inet_addr local_addr;
+  union nf_inet_addr remote_addr;
+  __be16 local_port;
+  __be16 remote_port;
+  u_int16_t family;		// AF_INET or AF_INET6
+  u_int16_t pad;
+};
+
+#define FLOW_KEY_WORDS (sizeof(struct tm_flow_key) / sizeof(u_int32_t))
+
+/*
+ * Fill in the key of an IPv4 TCP packet. 'incoming'
+ * tells if the packet is going to the phone (local in)
+ * or coming from it (local out).
+ */
+static inline void set_flow_key_ipv4(struct tm_flow_key *key, const struct iphdr *iph,
+                                     const struct tcphdr *tcph, int incoming) {
+
+  memset(key, 0, sizeof(*key));
+  key->family = AF_INET;
+
+  if (incoming) {
+    key->local_addr.ip = iph->daddr;
+    key->remote_addr.ip = iph->saddr;
+    key->local_port = tcph->dest;
+    key->remote_port = tcph->source;
+  } else {
+    key->local_addr.ip = iph->saddr;
+    key->remote_addr.ip = iph->daddr;
+    key->local_port = tcph->source;
+    key->remote_port = tcph->dest;
+  }
+}
+
+static inline u_int32_t flow_key_hash(const struct tm_flow_key *key, u_int32_t seed) {
+  return jhash2((const u_int32_t *) key, FLOW_KEY_WORDS, seed);
+}
+
+static inline int flow_key_equal(const struct tm_flow_key *a, const struct tm_flow_key *b) {
+  return memcmp(a, b, sizeof(struct tm_flow_key)) == 0;
+}
+
+#endif /* FLOWKEY_H_ */
@@ -0,0 +1,179 @@
+/* 
+ * This file is part of TrafficMonitor.
+ * 
+ * Copyright (C) 2011, Ahmad Nazir, Mohammad Hoque, Wei Li and Aki Saarinen.
+ * 
+ * TrafficMonitor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * TrafficMonitor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with TrafficMonitor.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LATENCY_H_
+#define LATENCY_H_
+
+#include <linux/debugfs.h>
+#include <linux/log2.h>
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
+#include <linux/uaccess.h>
+#include <asm/local.h>
+
+#include "common.h"
+#include "clock.h"
+
+/**
+ * Hook Latency
+ *
+ * With the hook_latency diagnostics on (common.h) every
+ * call of the hooks is timed and counted in a log2
+ * histogram per hook and per code path: bucket n holds
+ * the calls that took [2^(n-1), 2^n) nanoseconds. The
+ * histograms are per CPU like the statistics and are
+ * read from /sys/kernel/debug/trafficmonitor/hook_latency;
+ * writing anything to that file resets them.
+ *
+ * A call starts at the time the hook reads for the
+ * packet anyway (clock.h), so the timing only costs one
+ * more clock read at the end. Switching hook_latency
+ * off again removes that too, so comparing the stats
+ * with it on and off shows the overhead of the
+ * instrumentation.
+ */
+#define TM_HOOK_IN 0
+#define TM_HOOK_OUT 1
+#define TM_HOOK_MAX 2
+
+/*
+ * Code paths, a call is counted under the last one it
+ * went through.
+ */
+#define TM_PATH_TCP				0	// any other TCP packet
+#define TM_PATH_NOT_TCP			1	// early return for other protocols
+#define TM_PATH_NEW_CONNECTION	2	// a connection was added
+#define TM_PATH_BURST			3	// a burst packet, an event was made
+#define TM_PATH_WINDOW			4	// the receive window was rewritten
+#define TM_PATH_WINDOW_GSO		5	// the same for a GSO packet of several segments
+#define TM_PATH_MAX				6
+
+#define TM_LATENCY_BUCKETS 32	// the last one also takes everything longer
+
+static const char * const tm_hook_names[TM_HOOK_MAX] = { "in", "out" };
+static const char * const tm_path_names[TM_PATH_MAX] = {
+  "tcp", "not_tcp", "new_connection", "burst", "window", "window_gso",
+};
+
+struct tm_latency {
+  local_t buckets[TM_HOOK_MAX][TM_PATH_MAX][TM_LATENCY_BUCKETS];
+};
+
+static DEFINE_PER_CPU(struct tm_latency, tm_latency);
+static struct dentry *latency_file = NULL;
+
+static inline void record_hook_latency(int hook, u_int8_t path, u64 ns)
+{
+  unsigned int bucket = ns > 0xffffffffULL ? TM_LATENCY_BUCKETS - 1 : fls((u32) ns);
+
+  if (bucket >= TM_LATENCY_BUCKETS)
+    bucket = TM_LATENCY_BUCKETS - 1;
+
+  local_inc(&get_cpu_var(tm_latency).buckets[hook][path][bucket]);
+  put_cpu_var(tm_latency);
+}
+
+static unsigned long latency_sum(int hook, int path, int bucket)
+{
+  unsigned long sum = 0;
+  int cpu;
+
+  for_each_possible_cpu(cpu)
+    sum += local_read(&per_cpu(tm_latency, cpu).buckets[hook][path][bucket]);
+
+  return sum;
+}
+
+/*
+ * One line per hook and path that has been taken:
+ * the number of calls, then the non empty buckets as
+ * <upper bound in ns>:<calls>
+ */
+static int latency_show(struct seq_file *m, void *v)
+{
+  int hook, path, bucket;
+
+  for (hook = 0; hook < TM_HOOK_MAX; hook++) {
+    for (path = 0; path < TM_PATH_MAX; path++) {
+      unsigned long counts[TM_LATENCY_BUCKETS];
+      unsigned long total = 0;
+
+      for (bucket = 0; bucket < TM_LATENCY_BUCKETS; bucket++) {
+        counts[bucket] = latency_sum(hook, path, bucket);
+        total += counts[bucket];
+      }
+
+      if (total == 0)
+        continue;
+
+      seq_printf(m, "%s %s %lu", tm_hook_names[hook], tm_path_names[path], total);
+      for (bucket = 0; bucket < TM_LATENCY_BUCKETS; bucket++) {
+        if (counts[bucket] > 0)
+          seq_printf(m, " %lu:%lu", 1UL << bucket, counts[bucket]);
+      }
+      seq_printf(m, "\n");
+    }
+  }
+
+  return 0;
+}
+
+static void reset_latency(void)
+{
+  int cpu, hook, path, bucket;
+
+  for_each_possible_cpu(cpu)
+    for (hook = 0; hook < TM_HOOK_MAX; hook++)
+      for (path = 0; path < TM_PATH_MAX; path++)
+        for (bucket = 0; bucket < TM_LATENCY_BUCKETS; bucket++)
+          local_set(&per_cpu(tm_latency, cpu).buckets[hook][path][bucket], 0);
+}
+
+static int latency_open(struct inode *inode, struct file *file)
+{
+  return single_open(file, latency_show, NULL);
+}
+
+static ssize_t latency_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
+{
+  reset_latency();
+  return count;
+}
+
+static const struct file_operations latency_fops = {
+  .owner = THIS_MODULE,
+  .open = latency_open,
+  .read = seq_read,
+  .write = latency_write,
+  .llseek = seq_lseek,
+  .release = single_release,
+};
+
+static void init_latency(struct dentry *parent)
+{
+  latency_file = debugfs_create_file("hook_latency", 0644, parent, NULL, &latency_fops);
+}
+
+static void destroy_latency(void)
+{
+  debugfs_remove(latency_file);
+  latency_file = NULL;
+}
+
+#endif /* LATENCY_H_ */
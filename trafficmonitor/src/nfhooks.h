@@ -29,10 +29,13 @@
 #include <linux/netfilter_ipv4.h>
 #include <net/ip.h>
 #include <net/tcp.h>
+#include <net/inet_hashtables.h>	// inet_lookup_established()
 #include <linux/time.h>
 //#include "connections.h"
 //#include "wireless.h" 					// is_wnic_sleep();
 #include "common.h"
+#include "latency.h"
+#include "packet.h"
 
 #define BURST_SIZE_RATIO 3
 #define NETWORK_DELAY_FACTOR 4
@@ -40,12 +43,17 @@
 
 //static struct nf_hook_ops post_nfho, pre_nfho;
 
-static inline void set_tcp_window_size(struct sk_buff* my_skb,struct tcphdr* tcph, struct iphdr* iph, u_int32_t window_size, u_int16_t window_scale);
+static inline void set_tcp_window_size(struct sk_buff* my_skb, const struct tm_packet* packet, u_int32_t window_size, u_int16_t window_scale);
 
-extern void newPacket(u_int32_t connection_id, unsigned int size, int direction, bool newConnection);
+extern void newPacket(struct constate *connection, const struct tm_packet *packet, int direction,
+                      bool newConnection, u64 now);
 
-static bool OnChocking = false;
+static bool OnChocking = false;		// global choke switch, see also choke.h
 
+/*
+ * Wall clock in microseconds, only for the log line at
+ * module load. The packets use tm_now() (clock.h).
+ */
 inline long long unsigned gettime() {
         struct timeval tv;
         do_gettimeofday(&tv);
@@ -53,12 +61,29 @@ inline long long unsigned gettime() {
 }
 /**
  * LOGGING HELPER
+ *
+ * The packets are logged through the tm_packet
+ * tracepoint (tm_trace.h) whenever it is enabled. With
+ * dmesg_compat the packets are also printed to the
+ * kernel log in the old format that the analysis
+ * scripts read, if 'print' is set, i.e. the
+ * diagnostics of the caller are on:
+ * TM <= 12345 burst, ack 1, seq 2, size 1500
+ * Printing every packet is slow, so it is off unless
+ * asked for.
  */
 #define DIR_IN 0
 #define DIR_OUT 1
 
-static void print_packet_info(u_int32_t connection_id, struct tcphdr* tcph, struct iphdr* iph, struct sk_buff* skb, const int direction, const char* packet_type) 
+static bool dmesg_compat = false;
+module_param(dmesg_compat, bool, 0644);
+MODULE_PARM_DESC(dmesg_compat, "Also print the packets to the kernel log in the old TM text format");
+
+static inline void print_packet_info(u_int32_t connection_id, struct tcphdr* tcph, struct iphdr* iph, struct sk_buff* skb, const int direction, const char* packet_type, bool print) 
 {
+  trace_tm_packet(connection_id, direction, packet_type, tcph->ack_seq, tcph->seq, skb->len);
+
+  if (print && dmesg_compat)
     printk(KERN_INFO "TM %s %u %s, ack %u, seq %u, size %u",
             direction == DIR_IN ? "<=" : "=>",
             connection_id,
@@ -68,26 +93,72 @@ static void print_packet_info(u_int32_t connection_id, struct tcphdr* tcph, stru
             skb->len);
 }
 
+static inline void set_burst_stage(struct constate *connection, u_int8_t stage)
+{
+  trace_tm_burst_stage(connection->connection_id, connection->burst_stage, stage);
+  connection->burst_stage = stage;
+}
+
+/*
+ * Owner of the socket sending the packet, cached in
+ * the connection the first time it is seen. Orphaned
+ * sockets have no owner any more.
+ *
+ * The process is taken from a packet sent outside of
+ * interrupt context, i.e. from a system call of the
+ * process itself, not from the TCP timers or an ACK
+ * sent in reply to an incoming packet.
+ */
+static inline uid_t packet_owner(struct constate *connection, struct sk_buff *skb)
+{
+  uid_t uid;
+
+  if (skb->sk == NULL || skb->sk->sk_socket == NULL)
+    return connection != NULL ? connection->uid : TM_UID_UNKNOWN;
+
+  if (connection == NULL)
+    return sock_i_uid(skb->sk);
+
+  if (connection->pid == TM_PID_UNKNOWN && !in_interrupt())
+    connection->pid = task_tgid_nr(current);
+
+  if (connection->uid != TM_UID_UNKNOWN)
+    return connection->uid;
+
+  uid = sock_i_uid(skb->sk);
+  connection->uid = uid;
+  return uid;
+}
+
 /**
  * NETFILTER HOOKS
+ *
+ * The hooks are called by the netfilter core under
+ * rcu_read_lock(), so the connections returned by
+ * get_connection() and add_connection() stay valid
+ * until the hook returns. No locks are taken here.
+ *
+ * Whether the packet is logged and sent to the user
+ * space is decided once per packet by the event filter
+ * (filter.h), the connection is tracked either way.
+ *
+ * 'now' is the time of the packet, read once by the
+ * hook entry points (clock.h) and used for everything
+ * the packet does.
  */
 
-static unsigned int hook_local_in(unsigned int hooknum, struct sk_buff *skb, const struct net_device *in, const struct net_device *out, int(*okfn)(struct sk_buff *))
+static unsigned int __hook_local_in(unsigned int hooknum, struct sk_buff *skb, const struct net_device *in, const struct net_device *out, int(*okfn)(struct sk_buff *), u_int8_t *path, u64 now)
 {
   struct tcphdr* tcph;
   struct iphdr* iph;
   struct sk_buff* my_skb;
+  struct tm_packet packet;
   
   u_int32_t connection_id;
+  struct tm_flow_key key;
+  u_int32_t hash;
  
-  unsigned int skb_len = 0;
-  unsigned int iph_len = 0;
-  unsigned int tcph_len = 20;		// TCP header
-  unsigned int tcp_opt_len = 0;	// TCP options
   unsigned int tcp_payload = 0;
-  unsigned int segment_size = 0;	// TCP Options + TCP payload,
-									// corresponds to the MSS value
-									// set during TCP Handshake
 
   my_skb = skb;
 
@@ -97,117 +168,102 @@ static unsigned int hook_local_in(unsigned int hooknum, struct sk_buff *skb, con
     return NF_ACCEPT;
   }
   
-  skb_len = my_skb->len;
-
-
-  iph = ip_hdr(my_skb);
-  if (!iph)
+  if (parse_packet(my_skb, &packet) != 0)
   {
-    printk(KERN_INFO "Hook: IP header error\n");
+    tm_stat_inc(TM_STAT_TRUNCATED);
     return NF_ACCEPT;
   }
+  iph = packet.iph;
 
 
-  if (iph->protocol != 6)
+  tm_stat_inc(TM_STAT_IN_PACKETS);
+  tm_stat_add(TM_STAT_IN_SEGMENTS, packet.segments);
+  tm_stat_add(TM_STAT_IN_BYTES, my_skb->len);
+
+  if (packet.tcph == NULL)
   {
-#ifdef OTHER_PACKET
-    printk(KERN_INFO "TM <= Not a TCP packet. Protocol: %u\n", iph->protocol);
-#endif
+    tm_stat_inc(TM_STAT_IN_OTHER);
+    *path = TM_PATH_NOT_TCP;
+    if (tm_diag_enabled(&diag_other_packet))
+      printk(KERN_INFO "TM <= Not a TCP packet. Protocol: %u\n", iph->protocol);
     return NF_ACCEPT; // if not TCP packet
 
   }
-  
-
-  iph_len = ip_hdrlen(my_skb);
-
-  /**
-   * Even though the following statement should
-   * return the tcp header but it only works in case
-   * of outgoing packets.
-   *
-   * tcph = tcp_hdr(my_skb);
-   *
-   * Therefore we come up with our own way of casting.
-   *
-   * This problem only occurs from the incoming tcp
-   * packets.. maybe the headers are not initialized
-   * or what?
-   */
-
-  //temporary modification for testing
-  tcph = (struct tcphdr *) (my_skb->data + iph->ihl * 4);
-  //struct tcphdr *tcph2 = (struct tcphdr *) skb_transport_header(my_skb);
 
+  tm_stat_inc(TM_STAT_IN_TCP);
+  
   /*
-   * We have noticed that for wired ethernet connections,
-   * getting the tcph in the above manner works, but in
-   * case of wireless networks, tcph incorrectly points
-   * to the tcp flags like syn, ack, doff etc.
-   *
-   * todo: In order to cater for that, we need to get these
-   * values manually.
+   * The TCP header used to be found by casting
+   * skb->data + ihl * 4, since tcp_hdr() is not set up
+   * yet for incoming packets. parse_packet() reads it
+   * from the same place, also when it is paged.
    */
-
-  tcp_opt_len = (tcph->doff * 4) - (sizeof(struct tcphdr));
-
+  tcph = packet.tcph;
 
   /**
-   * Calculating TCP Payload
+   * Calculating TCP Payload, of all the segments of
+   * a GRO packet
    */
-  tcp_payload = skb_len - tcph_len - tcp_opt_len - iph_len;
-  //  tcp_payload = skb_len - iph_len;
-  
-  segment_size = tcp_payload + tcp_opt_len;
+  tcp_payload = packet.payload;
   
   
 
   /*
    * Connection id is destination port.. for incoming traffic
+   * The flow key is hashed once and the same hash is used
+   * for the lookup and when adding the connection.
    */
-  connection_id = ntohs(tcph->dest);
+  set_flow_key_ipv4(&key, iph, tcph, 1);
+  hash = connection_hash(&all_connections, &key);
+  connection_id = ntohs(key.local_port);
 
-  struct constate *connection = get_connection(&all_connections_head, connection_id);
+  struct constate *connection = get_connection(&all_connections, &key, hash);
+
+  bool capture = capture_packet(TM_FILTER_DOWNLINK, &key, tcp_payload,
+                                connection ? connection->uid : TM_UID_UNKNOWN);
 
   if ((connection == NULL)) {
     
-#ifdef ONLY_SHOW_SYN_ACK
-    //printk(KERN_INFO "TM <= New connection: the connection ID: %u, SYN bit: %u, ACK bit: %u", connection_id, tcph->syn, tcph->ack);
-    //printk(KERN_INFO "TM <= %u new, ack %u", connection_id, tcph->ack);
-    print_packet_info(connection_id, tcph, iph, skb, DIR_IN, "new");
-    return NF_ACCEPT;
-#endif
+    if (tm_diag_enabled(&diag_only_show_syn_ack)) {
+      //printk(KERN_INFO "TM <= New connection: the connection ID: %u, SYN bit: %u, ACK bit: %u", connection_id, tcph->syn, tcph->ack);
+      //printk(KERN_INFO "TM <= %u new, ack %u", connection_id, tcph->ack);
+      if (capture) print_packet_info(connection_id, tcph, iph, skb, DIR_IN, "new", true);
+      return NF_ACCEPT;
+    }
     
     if (tcph->syn) {
       
       if(tcph->ack)
       {
         // The last state parameter is not used any more. So don't bother if it is SYNED or CLOSED
-        add_connection(&all_connections_head, iph, tcph, connection_id, SYNED);
-        struct constate *newConnection = get_connection(&all_connections_head, connection_id);
-        newConnection->burst_stage = SYN_ACK;
+        struct constate *newConnection = add_connection(&all_connections, &key, hash, iph, tcph, SYNED);
+        if (newConnection == NULL)
+          return NF_ACCEPT;
+        *path = TM_PATH_NEW_CONNECTION;
+        set_burst_stage(newConnection, SYN_ACK);
+        set_handshake_options(newConnection, my_skb, &packet, 1);
 
         // We don't deal with such traffic because we assume the module is loaded before any TCP traffic starts
 
-#ifdef DISPLAY_BURST_STAGE
         //printk(KERN_INFO "TM <= Got a SYN-ACK packet for a non-existing connection. With connection ID: %u and ACK value: %u. Might be the connection had been established before EC module started. The connection was added to the list and the stage tis SYN-ACK\n", connection_id, tcph->ack_seq);
         //printk(KERN_INFO "TM <= %u new_synack, ack %u\n", connection_id, tcph->ack_seq);
-        print_packet_info(connection_id, tcph, iph, skb, DIR_IN, "new_synack");
-#endif
+        if (capture) print_packet_info(connection_id, tcph, iph, skb, DIR_IN, "new_synack", tm_diag_enabled(&diag_burst_stage));
       }
       
       else
       {
         // The last state parameter is not used any more. So don't bother if it is SYNED or CLOSED
-        add_connection(&all_connections_head, iph, tcph, connection_id, SYNED);
-        struct constate *newConnection = get_connection(&all_connections_head, connection_id);
+        struct constate *newConnection = add_connection(&all_connections, &key, hash, iph, tcph, SYNED);
+        if (newConnection == NULL)
+          return NF_ACCEPT;
+        *path = TM_PATH_NEW_CONNECTION;
         newConnection->direction = 1;
-        newConnection->burst_stage = SYN;
+        set_burst_stage(newConnection, SYN);
+        set_handshake_options(newConnection, my_skb, &packet, 1);
 
-#ifdef DISPLAY_BURST_STAGE
         //printk(KERN_INFO "TM <= Got a SYN packet for a non-existing connection. With connection ID: %u and ACK value: %u. Should not happen currently since mobile is not acting as server.  \n", connection_id, tcph->ack_seq);
         //printk(KERN_INFO "TM <= %u new_syn, ack %u\n", connection_id, tcph->ack_seq);
-        print_packet_info(connection_id, tcph, iph, skb, DIR_IN, "new_syn");
-#endif
+        if (capture) print_packet_info(connection_id, tcph, iph, skb, DIR_IN, "new_syn", tm_diag_enabled(&diag_burst_stage));
         
       }
       
@@ -215,64 +271,68 @@ static unsigned int hook_local_in(unsigned int hooknum, struct sk_buff *skb, con
     } else if (tcph->fin) {
 
       // The last state parameter is not used any more. So don't bother if it is SYNED or CLOSED
-      add_connection(&all_connections_head, iph, tcph, connection_id, SYNED);
-      struct constate *newConnection = get_connection(&all_connections_head, connection_id);
-      newConnection->burst_stage = FIN;
+      struct constate *newConnection = add_connection(&all_connections, &key, hash, iph, tcph, SYNED);
+      if (newConnection == NULL)
+        return NF_ACCEPT;
+      *path = TM_PATH_NEW_CONNECTION;
+      set_burst_stage(newConnection, FIN);
+      mark_connection_closing(newConnection);
 
       // We don't deal with such traffic because we assume the module is loaded before any TCP traffic starts
 
-#ifdef DISPLAY_BURST_STAGE
       //printk(KERN_INFO "TM => Got a FIN packet for a non-existing connection. With conneciton ID: %u and ACK value: %u. Might be the connection had been established before EC module started. The connection was added to the list and the stage tis FIN", connection_id, tcph->ack_seq);
       //printk(KERN_INFO "TM <= %u new_fin, ack %u\n", connection_id, tcph->ack_seq);
-      print_packet_info(connection_id, tcph, iph, skb, DIR_IN, "new_fin");
-#endif   
+      if (capture) print_packet_info(connection_id, tcph, iph, skb, DIR_IN, "new_fin", tm_diag_enabled(&diag_burst_stage));
 
     } else if(tcp_payload > BURST_THRESHOLD_BEGINNING)
     {
       // The last state parameter is not used any more. So don't bother if it is SYNED or CLOSED
-      add_connection(&all_connections_head, iph, tcph, connection_id, SYNED);
-      struct constate *newConnection = get_connection(&all_connections_head, connection_id);
-      newConnection->burst_stage = BURST_START;
+      struct constate *newConnection = add_connection(&all_connections, &key, hash, iph, tcph, SYNED);
+      if (newConnection == NULL)
+        return NF_ACCEPT;
+      *path = TM_PATH_NEW_CONNECTION;
+      set_burst_stage(newConnection, BURST_START);
 
       // We don't deal with such traffic because we assume the module is loaded before any TCP traffic starts
 
-#ifdef DISPLAY_BURST_STAGE
       //printk(KERN_INFO "TM => Got a normal burst packet for a non-existing connection. With conneciton ID: %u and ACK value: %u. Might be the connection had been established before EC module started. The connection was added to the list and the stage tis BURST_START\n", connection_id, tcph->ack_seq);
       //printk(KERN_INFO "TM <= %u new_burst, ack %u\n", connection_id, tcph->ack_seq);
-      print_packet_info(connection_id, tcph, iph, skb, DIR_IN, "new_burst");
-#endif      
+      if (capture) print_packet_info(connection_id, tcph, iph, skb, DIR_IN, "new_burst", tm_diag_enabled(&diag_burst_stage));
     }
 
     // We don't deal with such traffic because we assume the module is loaded before any TCP traffic starts
     else {
-#ifdef DISPLAY_BURST_STAGE
 //      printk(KERN_INFO "TM <= Got an unknown type packet for a non-existing connection. With conneciton ID: %u and ACK value: %u. Since there is no way to know the status of the connection, it is not added to the connection list.\n", connection_id, tcph->ack_seq);
-#endif
     }
     
   } 
 
   else { // connection != NULL
 
-    
-    refresh_rtt(connection, my_skb);
-    update_tcpi_rtt(connection, my_skb);
+    connection->last_seen = jiffies;
+    count_connection_packet(connection, &packet, 1);
+    if (tcph->fin || tcph->rst)
+      mark_connection_closing(connection);
 
+    sample_rtt(connection, my_skb, now);
 
-#ifdef ONLY_SHOW_SYN_ACK
-    printk(KERN_INFO "TM <= Existing connection: the connection ID: %u, SYN bit: %u, ACK bit: %u",connection_id, tcph->syn, tcph->ack);
-    return NF_ACCEPT;
-#endif
+    // A retransmitted SYN, or the SYN-ACK answering ours
+    if (tcph->syn)
+      set_handshake_options(connection, my_skb, &packet, 1);
+
+
+    if (tm_diag_enabled(&diag_only_show_syn_ack)) {
+      printk(KERN_INFO "TM <= Existing connection: the connection ID: %u, SYN bit: %u, ACK bit: %u",connection_id, tcph->syn, tcph->ack);
+      return NF_ACCEPT;
+    }
 
     
     if (connection->burst_stage == SYN && tcph->ack)
     {
-      connection->burst_stage = SYN_ACK;
-#ifdef DISPLAY_BURST_STAGE
+      set_burst_stage(connection, SYN_ACK);
       //printk(KERN_INFO "TM <= burst_stage changed to SYN_ACK. With connection ID: %u and ACK value: %u \n", connection_id, tcph->ack_seq);
       //printk(KERN_INFO "TM <= %u burst_synack, ack %u\n", connection_id, tcph->ack_seq);
-      print_packet_info(connection_id, tcph, iph, skb, DIR_IN, "burst_synack");
-#endif
+      if (capture) print_packet_info(connection_id, tcph, iph, skb, DIR_IN, "burst_synack", tm_diag_enabled(&diag_burst_stage));
       //      connection->direction = 0;
 
       // TODO: Generate NEW_BURST event.
@@ -281,28 +341,21 @@ static unsigned int hook_local_in(unsigned int hooknum, struct sk_buff *skb, con
     
     else if (connection->burst_stage==SYN_ACK && tcph->ack)
     {
-      connection->burst_stage = BURST_ESTABLISHED;
-#ifdef DISPLAY_BURST_STAGE
+      set_burst_stage(connection, BURST_ESTABLISHED);
       //printk(KERN_INFO "TM <= burst_stage changed to BURST_ESTABLISHED. With connection ID: %u and ACK value: %u. Should not happen currently since mobile is not acting as server \n", connection_id, tcph->ack_seq);
       //printk(KERN_INFO "TM <= %u burst_established, ack %u\n", connection_id, tcph->ack_seq);
-      print_packet_info(connection_id, tcph, iph, skb, DIR_IN, "burst_established");
-#endif
+      if (capture) print_packet_info(connection_id, tcph, iph, skb, DIR_IN, "burst_established", tm_diag_enabled(&diag_burst_stage));
       
     }
     else if(connection->burst_stage == BURST_ESTABLISHED)
     {
       connection->burst_stage == BURST_REQUEST;
 
-#ifdef DISPLAY_BURST_STAGE
       //printk(KERN_INFO "TM <= Got the burst request packet burst packet. With connection ID: %u and ACK value: %u.  Burst_stage changed to BURST_REQUEST.Should not happen currently since the mobile is not acting as server. \n", connection_id, tcph->ack_seq);
       //printk(KERN_INFO "TM <= %u burst_request, ack %u\n", connection_id, tcph->ack_seq);
-      print_packet_info(connection_id, tcph, iph, skb, DIR_IN, "burst_request");
-#endif
+      if (capture) print_packet_info(connection_id, tcph, iph, skb, DIR_IN, "burst_request", tm_diag_enabled(&diag_burst_stage));
 
-      struct timeval tv;
-      do_gettimeofday(&tv);
-      unsigned long timeCurrent = tv.tv_sec*1000000+tv.tv_usec;
-      connection->timeStamp = timeCurrent;
+      connection->timeStamp = now;
  
       // TODO:
     }
@@ -310,15 +363,15 @@ static unsigned int hook_local_in(unsigned int hooknum, struct sk_buff *skb, con
 
     else if(connection->burst_stage == BURST_REQUEST)
     {
-      connection->burst_stage = BURST_START;
+      set_burst_stage(connection, BURST_START);
 
-#ifdef DISPLAY_BURST_STAGE
       //printk(KERN_INFO "TM <= Got the first real burst packet. With connection ID: %u and ACK value: %u.  Burst_stage changed to BURST_REQUEST. \n", connection_id, tcph->ack_seq);
       //printk(KERN_INFO "TM <= %u burst_request, ack %u\n", connection_id, tcph->ack_seq);
-      print_packet_info(connection_id, tcph, iph, skb, DIR_IN, "burst_request");
-#endif
+      if (capture) print_packet_info(connection_id, tcph, iph, skb, DIR_IN, "burst_request", tm_diag_enabled(&diag_burst_stage));
+      
+      *path = TM_PATH_BURST;
       
-      newPacket(connection_id, tcp_payload, 1, true);
+      if (capture) newPacket(connection, &packet, 1, true, now);
     }
     
     else if(connection->burst_stage == BURST_START)
@@ -327,40 +380,39 @@ static unsigned int hook_local_in(unsigned int hooknum, struct sk_buff *skb, con
       if(connection->direction==0) // when this is a download flow. We only send the real tcp traffic on the main direction
       {
 
-#ifdef DISPLAY_BURST_STAGE
         //printk(KERN_INFO "TM <= Got another burst packet. With connection ID: %u and ACK value: %u.\n", connection_id, tcph->ack_seq);
         //printk(KERN_INFO "TM <= %u burst, ack %u\n", connection_id, tcph->ack_seq);
-        print_packet_info(connection_id, tcph, iph, skb, DIR_IN, "burst");
-#endif
+        if (capture) print_packet_info(connection_id, tcph, iph, skb, DIR_IN, "burst", tm_diag_enabled(&diag_burst_stage));
         
-        newPacket(connection_id, tcp_payload, 1, false);
+        *path = TM_PATH_BURST;
+        
+        if (capture) newPacket(connection, &packet, 1, false, now);
       }
       else
       {
 
-#ifdef DISPLAY_BURST_STAGE
         //printk(KERN_INFO "TM <= This is just an ACK packet to the real burst packet on the upload direction. With the connection ID: %u.  Hence it is not part of the burst traffic.\n", connection_id);
         //printk(KERN_INFO "TM <= %u ack_only, ack %u\n", connection_id, tcph->seq);
-        print_packet_info(connection_id, tcph, iph, skb, DIR_IN, "ack_only");
-#endif
+        if (capture) print_packet_info(connection_id, tcph, iph, skb, DIR_IN, "ack_only", tm_diag_enabled(&diag_burst_stage));
         
       }
       
     }
   }
 
-#ifndef ONLY_SHOW_SYN_ACK
   return NF_ACCEPT;
-#endif
 }
 
 
-static unsigned int hook_local_out(unsigned int hooknum, struct sk_buff *skb, const struct net_device *in, const struct net_device *out, int(*okfn)(struct sk_buff *))
+static unsigned int __hook_local_out(unsigned int hooknum, struct sk_buff *skb, const struct net_device *in, const struct net_device *out, int(*okfn)(struct sk_buff *), u_int8_t *path, u64 now)
 {
   struct tcphdr* tcph;
   struct iphdr* iph;
   struct sk_buff* my_skb;
   u_int32_t connection_id;
+  struct tm_flow_key key;
+  u_int32_t hash;
+  struct tm_packet packet;
   my_skb = skb;
   if (!my_skb)
   {
@@ -368,164 +420,177 @@ static unsigned int hook_local_out(unsigned int hooknum, struct sk_buff *skb, co
     return NF_ACCEPT;
   }
   
-  iph = ip_hdr(my_skb);
-  if (!iph)
+  if (parse_packet(my_skb, &packet) != 0)
   {
-    printk(KERN_INFO "TM => IP header error\n");
+    tm_stat_inc(TM_STAT_TRUNCATED);
     return NF_ACCEPT;
   }
+  iph = packet.iph;
   
-  if (iph->protocol != 6) // if not TCP packet
+  tm_stat_inc(TM_STAT_OUT_PACKETS);
+  tm_stat_add(TM_STAT_OUT_SEGMENTS, packet.segments);
+  tm_stat_add(TM_STAT_OUT_BYTES, my_skb->len);
+
+  if (packet.tcph == NULL) // if not TCP packet
   {
-    printk(KERN_INFO "TM => Not a TCP packet. Protocol: %u ", iph->protocol);
+    tm_stat_inc(TM_STAT_OUT_OTHER);
+    *path = TM_PATH_NOT_TCP;
+    if (tm_diag_enabled(&diag_other_packet))
+      printk(KERN_INFO "TM => Not a TCP packet. Protocol: %u ", iph->protocol);
     return NF_ACCEPT;
   }
 
-  unsigned int iph_len = ip_hdrlen(my_skb);
-  tcph = tcp_hdr(my_skb);
+  tm_stat_inc(TM_STAT_OUT_TCP);
 
-  // To calculate the packet size
-  unsigned int skb_len = my_skb->len;
-  
-  //unsigned int tcp_opt_len = tcp_optlen(my_skb);
-  //unsigned int tcph_len = tcp_hdrlen(my_skb);
-  //unsigned int iph_len = iph->tot_len;
-
-  // Casting method
-  unsigned int tcph_len = 20;
-  struct tcphdr* tcph2 = (struct tcphdr *) (my_skb->data + iph->ihl * 4);
-  unsigned tcp_opt_len = (tcph2->doff * 4) - (sizeof(struct tcphdr));
-  
-  unsigned int tcp_payload = skb_len - tcph_len - tcp_opt_len - iph_len;
+  tcph = packet.tcph;
+
+  // TCP payload of all the segments of a TSO packet
+  unsigned int tcp_payload = packet.payload;
 
   
   /*
    * Connection id is source port.. for outgoing traffic
    */
   
-  connection_id = ntohs(tcph->source);
-#ifdef PRINT_PACKET
-  printk(KERN_INFO "Hook: connection ID: %u", connection_id );
-#endif
+  set_flow_key_ipv4(&key, iph, tcph, 0);
+  hash = connection_hash(&all_connections, &key);
+  connection_id = ntohs(key.local_port);
+  if (tm_diag_enabled(&diag_print_packet))
+    printk(KERN_INFO "Hook: connection ID: %u", connection_id );
 
 
     
   /*
-   * Get Connection from connection_id
+   * Get Connection from the flow key
    */
-  struct constate *connection = get_connection(&all_connections_head, connection_id);
+  struct constate *connection = get_connection(&all_connections, &key, hash);
+
+  bool capture = capture_packet(TM_FILTER_UPLINK, &key, tcp_payload,
+                                packet_owner(connection, my_skb));
 
   if ((connection == NULL)) {
 
-#ifdef ONLY_SHOW_SYN_ACK
-    // printk(KERN_INFO "TM => New connection: the Connection ID: %u, SYN bit: %u, ACK bit: %u", connection_id, tcph->syn, tcph->ack);
-    //printk(KERN_INFO "TM => %u new, ack %u", connection_id, tcph->ack);
-      print_packet_info(connection_id, tcph, iph, skb, DIR_OUT, "new");
+    if (tm_diag_enabled(&diag_only_show_syn_ack)) {
+      // printk(KERN_INFO "TM => New connection: the Connection ID: %u, SYN bit: %u, ACK bit: %u", connection_id, tcph->syn, tcph->ack);
+      //printk(KERN_INFO "TM => %u new, ack %u", connection_id, tcph->ack);
+      if (capture) print_packet_info(connection_id, tcph, iph, skb, DIR_OUT, "new", true);
       return NF_ACCEPT;
-#endif
+    }
     
     if (tcph->syn) {
       if(tcph->ack)
       {
-        add_connection(&all_connections_head, iph, tcph, connection_id, ACKED);
-        struct constate *newConnection = get_connection(&all_connections_head, connection_id);
-        newConnection->burst_stage = SYN_ACK;
+        connection = add_connection(&all_connections, &key, hash, iph, tcph, ACKED);
+        if (connection == NULL)
+          return NF_ACCEPT;
+        *path = TM_PATH_NEW_CONNECTION;
+        set_burst_stage(connection, SYN_ACK);
+        set_handshake_options(connection, my_skb, &packet, 0);
 
         // We don't deal with such traffic because we assume the module is loaded before any TCP traffic starts
 
-#ifdef DISPLAY_BURST_STAGE
         //printk(KERN_INFO "TM => Sent a SYN-ACK packet for a non-existing connection. With conneciton ID: %u and ACK value: %u. Might be the connection had been established before EC module started. The connection was added to the list and the stage tis SYN-ACK.\n", connection_id, tcph->ack_seq);
         //printk(KERN_INFO "TM => %u new_synack, ack %u\n", connection_id, tcph->ack_seq);
-        print_packet_info(connection_id, tcph, iph, skb, DIR_OUT, "new_synack");
-#endif
+        if (capture) print_packet_info(connection_id, tcph, iph, skb, DIR_OUT, "new_synack", tm_diag_enabled(&diag_burst_stage));
         
       }
       
       else
       {
-        add_connection(&all_connections_head, iph, tcph, connection_id, SYNED);
-        struct constate *newConnection = get_connection(&all_connections_head, connection_id);
-        newConnection->burst_stage = SYN;
-        newConnection->direction = 0;
+        connection = add_connection(&all_connections, &key, hash, iph, tcph, SYNED);
+        if (connection == NULL)
+          return NF_ACCEPT;
+        *path = TM_PATH_NEW_CONNECTION;
+        set_burst_stage(connection, SYN);
+        connection->direction = 0;
+        set_handshake_options(connection, my_skb, &packet, 0);
 
-#ifdef DISPLAY_BURST_STAGE
         //printk(KERN_INFO "TM => Sent a SYN packet for a non-existing connection. Burst_stage changed to SYN. With connection ID: %u and ACK value: %u \n", connection_id, tcph->ack_seq);
         //printk(KERN_INFO "TM => %u new_syn, ack %u\n", connection_id, tcph->ack_seq);
-        print_packet_info(connection_id, tcph, iph, skb, DIR_OUT, "new_syn");
-#endif
+        if (capture) print_packet_info(connection_id, tcph, iph, skb, DIR_OUT, "new_syn", tm_diag_enabled(&diag_burst_stage));
       }
 
     }  // if tcph->syn
     
     else if (tcph->fin) { // for debugging.
-      add_connection(&all_connections_head, iph, tcph, connection_id, CLOSED);
-      struct constate *newConnection = get_connection(&all_connections_head, connection_id);
-      newConnection->burst_stage = FIN;
+      connection = add_connection(&all_connections, &key, hash, iph, tcph, CLOSED);
+      if (connection == NULL)
+        return NF_ACCEPT;
+      *path = TM_PATH_NEW_CONNECTION;
+      set_burst_stage(connection, FIN);
+      mark_connection_closing(connection);
 
       // We don't deal with such traffic because we assume the module is loaded before any TCP traffic starts
       
 
-#ifdef DISPLAY_BURST_STAGE
     //printk(KERN_INFO "TM => Sent a FIN packet for a non-existing connection. With conneciton ID: %u and ACK value: %u. Might be the connection had been established before EC module started. The connection was added to the list and the stage tis FIN.\n", connection_id, tcph->ack_seq);
     //printk(KERN_INFO "TM => %u new_fin, ack %u \n", connection_id, tcph->ack_seq);
-        print_packet_info(connection_id, tcph, iph, skb, DIR_OUT, "new_fin");
-#endif
+        if (capture) print_packet_info(connection_id, tcph, iph, skb, DIR_OUT, "new_fin", tm_diag_enabled(&diag_burst_stage));
       
     } // if tcph->fin
 
     else if(tcp_payload > BURST_THRESHOLD_BEGINNING)
     {
-      add_connection(&all_connections_head, iph, tcph, connection_id, ACKED);
-      struct constate *newConnection = get_connection(&all_connections_head, connection_id);
-      newConnection->burst_stage = BURST_START;
+      connection = add_connection(&all_connections, &key, hash, iph, tcph, ACKED);
+      if (connection == NULL)
+        return NF_ACCEPT;
+      *path = TM_PATH_NEW_CONNECTION;
+      set_burst_stage(connection, BURST_START);
 
    // We don't deal with such traffic because we assume the module is loaded before any TCP traffic starts
       
-#ifdef DISPLAY_BURST_STAGE
       //printk(KERN_INFO "TM => Sent a burst traffic packet for a non-existing connection. With conneciton ID: %u and ACK value: %u. Might be the connection had been established before EC module started. The connection was added to the list and the stage is BURST_START.\n", connection_id, tcph->ack_seq);
       //printk(KERN_INFO "TM => %u new_burst, ack %u\n", connection_id, tcph->ack_seq);
-      print_packet_info(connection_id, tcph, iph, skb, DIR_OUT, "new_burst");
-#endif
+      if (capture) print_packet_info(connection_id, tcph, iph, skb, DIR_OUT, "new_burst", tm_diag_enabled(&diag_burst_stage));
     } 
     
     else {
       // We don't deal with such traffic because we assume the module is loaded before any TCP traffic starts
 
 
-#ifdef DISPLAY_BURST_STAGE
       //printk(KERN_INFO "TM => Sent an unknown type packet for a non-existing connection. With conneciton ID: %u and ACK value: %u. Since there is no way to know the status of the connection, it is not added to the connection list.\n", connection_id, tcph->ack_seq);
       //printk(KERN_INFO "TM => %u new_unknown, ack %u\n", connection_id, tcph->ack_seq);
-      print_packet_info(connection_id, tcph, iph, skb, DIR_OUT, "new_unknown");
-#endif
+      if (capture) print_packet_info(connection_id, tcph, iph, skb, DIR_OUT, "new_unknown", tm_diag_enabled(&diag_burst_stage));
       
       return NF_ACCEPT;
     }
 
-    connection = get_connection(&all_connections_head, connection_id);
   }
   else {  // connection != NULL : connection already exists
 
-    
-    update_rtt(connection, my_skb);
+    connection->last_seen = jiffies;
+    count_connection_packet(connection, &packet, 0);
+    if (tcph->fin || tcph->rst)
+      mark_connection_closing(connection);
 
+    sample_rtt(connection, my_skb, now);
 
-#ifdef ONLY_SHOW_SYN_ACK
-    printk(KERN_INFO "TM => Existing connection: the connection ID: %u, SYN bit: %u, ACK bit: %u", connection_id, tcph->syn, tcph->ack);
-    return NF_ACCEPT;
-#endif
+    /*
+     * Options come from the handshake. A connection
+     * opened before the module was loaded has none, ask
+     * its socket instead.
+     */
+    if (tcph->syn)
+      set_handshake_options(connection, my_skb, &packet, 0);
+    else if (connection->options_source == TM_OPTIONS_NONE)
+      set_socket_options(connection, my_skb);
+
+
+    if (tm_diag_enabled(&diag_only_show_syn_ack)) {
+      printk(KERN_INFO "TM => Existing connection: the connection ID: %u, SYN bit: %u, ACK bit: %u", connection_id, tcph->syn, tcph->ack);
+      return NF_ACCEPT;
+    }
 
 
     
     if (connection->burst_stage==SYN_ACK && tcph->ack)
     {
 
-      connection->burst_stage = BURST_ESTABLISHED;
+      set_burst_stage(connection, BURST_ESTABLISHED);
 
-#ifdef DISPLAY_BURST_STAGE
 //printk(KERN_INFO "TM => burst_stage changed to BURST_ESTABLISHED and send one ACK packet back to user remote server. With connection ID: %u and ACK value: %u. Waiting for real burst.\n ", connection_id, tcph->ack_seq);
       //printk(KERN_INFO "TM => %u burst_established, ack %u\n ", connection_id, tcph->ack_seq);
-      print_packet_info(connection_id, tcph, iph, skb, DIR_OUT, "burst_established");
-#endif
+      if (capture) print_packet_info(connection_id, tcph, iph, skb, DIR_OUT, "burst_established", tm_diag_enabled(&diag_burst_stage));
       
     }
     
@@ -533,33 +598,28 @@ static unsigned int hook_local_out(unsigned int hooknum, struct sk_buff *skb, co
     else if(connection->burst_stage == BURST_ESTABLISHED)
     {
       //      connection->burst_stage = BURST_START;
-      connection->burst_stage = BURST_REQUEST;
+      set_burst_stage(connection, BURST_REQUEST);
 
-#ifdef DISPLAY_BURST_STAGE
       //printk(KERN_INFO "TM => Sent the burst request packet. With connection ID: %u and ACK value: %u.  Burst_stage changed to BURST_REQUEST. \n", connection_id, tcph->ack_seq);
       //printk(KERN_INFO "TM => %u burst_request, ack %u\n", connection_id, tcph->ack_seq);
-      print_packet_info(connection_id, tcph, iph, skb, DIR_OUT, "burst_request");
-#endif
+      if (capture) print_packet_info(connection_id, tcph, iph, skb, DIR_OUT, "burst_request", tm_diag_enabled(&diag_burst_stage));
       
-      struct timeval tv;
-      do_gettimeofday(&tv);
-      unsigned long timeCurrent = tv.tv_sec*1000000+tv.tv_usec;
-      connection->timeStamp = timeCurrent;
+      connection->timeStamp = now;
 
     }
 
 
     else if(connection->burst_stage == BURST_REQUEST)
     {
-      connection->burst_stage = BURST_START;
+      set_burst_stage(connection, BURST_START);
 
-#ifdef DISPLAY_BURST_STAGE
       //printk(KERN_INFO "TM => Sent the first real burst packet. With connection ID: %u and ACK value: %u.  Burst_stage changed to BURST_REQUEST. Should not happen currently since the mobiel is not acting as server \n", connection_id, tcph->ack_seq);
       //printk(KERN_INFO "TM => %u burst_request, ack %u\n", connection_id, tcph->ack_seq);
-      print_packet_info(connection_id, tcph, iph, skb, DIR_OUT, "burst_request");
-#endif
+      if (capture) print_packet_info(connection_id, tcph, iph, skb, DIR_OUT, "burst_request", tm_diag_enabled(&diag_burst_stage));
+      
+      *path = TM_PATH_BURST;
       
-      newPacket(connection_id, tcp_payload, 0, true);
+      if (capture) newPacket(connection, &packet, 0, true, now);
     }
     
     
@@ -568,38 +628,34 @@ static unsigned int hook_local_out(unsigned int hooknum, struct sk_buff *skb, co
       if(connection->direction == 1)  // When this is a upload flow. We only send the real tcp traffic on the main direction
       {
         
-#ifdef DISPLAY_BURST_STAGE
         //printk(KERN_INFO "TM => Sent another burst packet. With connection ID: %u and ACK value: %u. \n", connection_id, tcph->ack_seq);
         //printk(KERN_INFO "TM => %u burst, ack %u\n", connection_id, tcph->ack_seq);
-        print_packet_info(connection_id, tcph, iph, skb, DIR_OUT, "burst");
-#endif
+        if (capture) print_packet_info(connection_id, tcph, iph, skb, DIR_OUT, "burst", tm_diag_enabled(&diag_burst_stage));
 
-        newPacket(connection_id, tcp_payload, 0, false);
+        *path = TM_PATH_BURST;
+
+        if (capture) newPacket(connection, &packet, 0, false, now);
       }
       
       else
       {
 
 
-#ifdef DISPLAY_BURST_STAGE
         //printk(KERN_INFO "TM => This is just an ACK packet to the real burst packet on the download direction. With the connection ID: %u. Hence it is not part of the burst traffic.\n", connection_id);
         //printk(KERN_INFO "TM => %u ack_only, ack %u\n", connection_id, tcph->seq);
-        print_packet_info(connection_id, tcph, iph, skb, DIR_OUT, "ack_only");
-#endif
+        if (capture) print_packet_info(connection_id, tcph, iph, skb, DIR_OUT, "ack_only", tm_diag_enabled(&diag_burst_stage));
       }
     }
 
     
     else if(connection->burst_stage == SYN && tcph->ack)
     {
-      connection->burst_stage = SYN_ACK;
+      set_burst_stage(connection, SYN_ACK);
 
 
-#ifdef DISPLAY_BURST_STAGE
       //printk(KERN_INFO "TM => burst_stage changed to SYN-ACK. With connection ID: %u and ACK value: %u. Should not happen currently since mobile is not acting as server.\n", connection_id, tcph->ack_seq);
       //printk(KERN_INFO "TM => %u burst_synack, ack %u\n", connection_id, tcph->ack_seq);
-      print_packet_info(connection_id, tcph, iph, skb, DIR_OUT, "burst_synack");
-#endif
+      if (capture) print_packet_info(connection_id, tcph, iph, skb, DIR_OUT, "burst_synack", tm_diag_enabled(&diag_burst_stage));
       
       //      connection->direction = 1;
       
@@ -607,53 +663,197 @@ static unsigned int hook_local_out(unsigned int hooknum, struct sk_buff *skb, co
     }   
   }
   
-  //  printk(KERN_INFO "TM => OnChocking flag: %b. Connection chocked flag: %b. \n", OnChocking, connection->chocked);
-  
-  //  When there is a chocking flag and this connection has not been chocked
-  if(OnChocking && !(connection->chocked))
+  // The packet was not worth a connection
+  if (connection == NULL)
+    return NF_ACCEPT;
+
+  /*
+   * Choke the connection when the global switch is on
+   * or a policy matches it (choke.h). The window the
+   * stack advertised is saved on the first choked
+   * packet, in units of the window scale as on the wire,
+   * for the record. The first packet after the choke
+   * keeps the window the stack gives it, which may have
+   * changed since.
+   */
+  if (OnChocking || choke_connection(&key, packet_owner(connection, my_skb), now))
   {
-    connection->previous_window_size = connection->window_size;
-    set_tcp_window_size(skb, tcph, iph, 0x00, 0);
+    if (!connection->chocked) {
+      connection->previous_window_size = ntohs(tcph->window);
+      connection->chocked = true;
+      trace_tm_choke(connection->connection_id, true, 0, 0);
+    }
+    set_tcp_window_size(skb, &packet, 0x00, 0);
+    *path = packet.segments > 1 ? TM_PATH_WINDOW_GSO : TM_PATH_WINDOW;
   }
-
-  // When there is an unchocking flag and this connection has been chocked
-  if(!OnChocking && connection->chocked)
+  else if (connection->chocked)
   {
-    connection->previous_window_size = connection->window_size;
-    set_tcp_window_size(skb, tcph, iph, connection->previous_window_size, connection->window_scale);
+    connection->chocked = false;
+    trace_tm_choke(connection->connection_id, false, ntohs(tcph->window), connection->window_scale);
   }
 
-#ifndef ONLY_SHOW_SYN_ACK
   return NF_ACCEPT;
-#endif
 
 }
 
+/*
+ * Have the socket of a connection send an ACK, which
+ * carries its current receive window, by running its
+ * delayed ACK timer now. This is what the stack does
+ * for a pending ACK, the kernel does not export a way
+ * to send one directly. IPv4 only, like the hooks.
+ */
+static void send_window_update(struct constate *connection)
+{
+  struct sock *sk;
+
+  if (connection->key.family != AF_INET)
+    return;
 
+  sk = inet_lookup_established(&init_net, &tcp_hashinfo,
+                               connection->key.remote_addr.ip, connection->key.remote_port,
+                               connection->key.local_addr.ip, connection->key.local_port, 0);
+  if (sk == NULL)
+    return;
+
+  if (sk->sk_state == TCP_TIME_WAIT) {
+    inet_twsk_put(inet_twsk(sk));
+    return;
+  }
 
+  bh_lock_sock(sk);
+  if (sk->sk_state == TCP_ESTABLISHED) {
+    inet_csk_schedule_ack(sk);
+    inet_csk_reset_xmit_timer(sk, ICSK_TIME_DACK, 0, TCP_RTO_MAX);
+  }
+  bh_unlock_sock(sk);
+  sock_put(sk);
+}
 
-static inline void set_tcp_window_size(struct sk_buff* my_skb, struct tcphdr* tcph, struct iphdr* iph, u_int32_t window_size, u_int16_t window_scale)
+/*
+ * Send a window update for every connection that was
+ * choked and is not any more, see choke.h. Run from
+ * the choke timer; the window itself is left as the
+ * stack sets it by the outgoing hook.
+ */
+static void restore_unchoked_connections(void)
 {
+  struct constate_hash *hash;
+  struct constate *node;
+  struct hlist_node *pos;
+  unsigned int bucket;
+  u64 now = tm_now();
 
-  u_int16_t tcplen;
+  if (OnChocking)
+    return;
+
+  rcu_read_lock();
+  hash = rcu_dereference(all_connections.hash);
+  for_each_connection_rcu(hash, node, bucket, pos) {
+    if (node->chocked && !choke_connection(&node->key, node->uid, now))
+      send_window_update(node);
+  }
+  rcu_read_unlock();
+}
 
-  if (my_skb == NULL || tcph == NULL || iph == NULL || window_scale<0 || window_size < 0)
+
+
+
+/**
+ * Receive window rewrite
+ *
+ * Only the 16 bit window changes, so the checksum is
+ * patched with the difference (RFC 1624) instead of
+ * being computed again over the whole segment; the
+ * cost does not depend on the payload, which matters
+ * for TSO packets.
+ *
+ * inet_proto_csum_replace2() leaves the checksum alone
+ * for CHECKSUM_PARTIAL packets, whose checksum is
+ * filled in later by the device or by the stack over
+ * the rewritten header. A packet whose header is
+ * shared with a clone is copied first.
+ *
+ * With window_csum_full the checksum is computed over
+ * the whole segment again, as it used to be, so that the
+ * "window" and "window_gso" paths of the hook_latency
+ * histograms can be compared for both ways on MSS and
+ * GSO sized packets. A CHECKSUM_PARTIAL packet still
+ * gets the incremental update, the full sum is only
+ * computed for the measurement.
+ */
+static bool window_csum_full = false;
+module_param(window_csum_full, bool, 0644);
+MODULE_PARM_DESC(window_csum_full, "Recompute the whole TCP checksum after a window rewrite, to compare its cost");
+
+static inline void set_tcp_window_size(struct sk_buff* my_skb, const struct tm_packet* packet, u_int32_t window_size, u_int16_t window_scale)
+{
+  struct tcphdr *tcph;
+  __be16 window = htons(window_size >> window_scale);
+  unsigned int tcp_len = my_skb->len - packet->ip_hdr_len;
+  __wsum csum;
+
+  if (packet->tcph->window == window)
     return;
 
-  tcplen = my_skb->len - ip_hdrlen(my_skb);
+  if (!skb_make_writable(my_skb, packet->ip_hdr_len + sizeof(struct tcphdr))) {
+    tm_stat_inc(TM_STAT_REWRITE_FAILURES);
+    return;
+  }
 
-  /*
-   * Set Window Size after scaling
-   */
-  tcph->window = htons(window_size>>window_scale);
+  // the headers may have moved
+  tcph = (struct tcphdr *) (my_skb->data + packet->ip_hdr_len);
 
-  /*
-   * Check sum
-   */
-  tcph->check = 0;
-  tcph->check = tcp_v4_check(tcplen, iph->saddr, iph->daddr, csum_partial(
-                                                                          (char *) tcph, tcplen, 0));
+  if (unlikely(window_csum_full) && my_skb->ip_summed != CHECKSUM_PARTIAL) {
+    tcph->window = window;
+    tcph->check = 0;
+    csum = skb_checksum(my_skb, packet->ip_hdr_len, tcp_len, 0);
+    tcph->check = csum_tcpudp_magic(ip_hdr(my_skb)->saddr, ip_hdr(my_skb)->daddr,
+                                    tcp_len, IPPROTO_TCP, csum);
+    my_skb->ip_summed = CHECKSUM_NONE;
+    return;
+  }
+
+  // only the cost is wanted here, the device fills the checksum in
+  if (unlikely(window_csum_full))
+    skb_checksum(my_skb, packet->ip_hdr_len, tcp_len, 0);
+
+  inet_proto_csum_replace2(&tcph->check, my_skb, tcph->window, window, 0);
+  tcph->window = window;
+}
+
+
+/**
+ * Hook entry points
+ *
+ * Read the clock once for the packet, and time the
+ * hooks when the hook_latency diagnostics are on, see
+ * latency.h.
+ */
+static unsigned int hook_local_in(unsigned int hooknum, struct sk_buff *skb, const struct net_device *in, const struct net_device *out, int(*okfn)(struct sk_buff *))
+{
+  u_int8_t path = TM_PATH_TCP;
+  unsigned int verdict;
+  u64 now = tm_now();
+
+  verdict = __hook_local_in(hooknum, skb, in, out, okfn, &path, now);
+  if (tm_diag_enabled(&diag_hook_latency))
+    record_hook_latency(TM_HOOK_IN, path, tm_now() - now);
+
+  return verdict;
+}
+
+static unsigned int hook_local_out(unsigned int hooknum, struct sk_buff *skb, const struct net_device *in, const struct net_device *out, int(*okfn)(struct sk_buff *))
+{
+  u_int8_t path = TM_PATH_TCP;
+  unsigned int verdict;
+  u64 now = tm_now();
+
+  verdict = __hook_local_out(hooknum, skb, in, out, okfn, &path, now);
+  if (tm_diag_enabled(&diag_hook_latency))
+    record_hook_latency(TM_HOOK_OUT, path, tm_now() - now);
 
+  return verdict;
 }
 
 
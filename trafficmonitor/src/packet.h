@@ -0,0 +1,191 @@
+/* 
+ * This file is part of TrafficMonitor.
+ * 
+ * Copyright (C) 2011, Ahmad Nazir, Mohammad Hoque, Wei Li and Aki Saarinen.
+ * 
+ * TrafficMonitor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * TrafficMonitor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with TrafficMonitor.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef PACKET_H_
+#define PACKET_H_
+
+#include <linux/ip.h>
+#include <linux/skbuff.h>
+#include <linux/tcp.h>
+#include <net/tcp.h>				// TCPOPT_*, TCPOLEN_*
+#include <asm/unaligned.h>
+
+/**
+ * Packet Parsing
+ *
+ * The IP and TCP headers are read with
+ * skb_header_pointer(), which points into the packet
+ * when the header is in its linear part and copies it
+ * into the tm_packet otherwise, so paged packets are
+ * parsed as well. Both hooks see the packet with
+ * skb->data at the IP header.
+ *
+ * With GSO and GRO one packet seen by the hooks stands
+ * for several segments on the wire. 'payload' is the
+ * TCP payload of all of them together, 'segments' and
+ * 'segment_size' come from gso_segs and gso_size, and
+ * are 1 and 0 for a plain packet.
+ */
+struct tm_packet {
+  struct iphdr *iph;
+  struct tcphdr *tcph;			// NULL if not TCP
+  unsigned int ip_hdr_len;
+  unsigned int tcp_hdr_len;		// including the options
+  unsigned int payload;			// TCP payload in bytes
+  u_int16_t segments;
+  u_int16_t segment_size;
+
+  struct iphdr _iph;			// copies of paged headers
+  struct tcphdr _tcph;
+};
+
+/*
+ * Number of segments the packet is sent or was
+ * received as.
+ */
+static inline u_int16_t packet_segments(const struct sk_buff *skb, unsigned int payload)
+{
+  const struct skb_shared_info *shinfo = skb_shinfo(skb);
+
+  if (!skb_is_gso(skb))
+    return 1;
+  if (shinfo->gso_segs)
+    return shinfo->gso_segs;
+  return DIV_ROUND_UP(payload, shinfo->gso_size);
+}
+
+/*
+ * Read the IP header, and the TCP header if the packet
+ * is TCP. Returns -1 if the headers are cut short.
+ */
+static inline int parse_packet(struct sk_buff *skb, struct tm_packet *packet)
+{
+  packet->tcph = NULL;
+  packet->payload = 0;
+  packet->segments = 1;
+  packet->segment_size = 0;
+
+  packet->iph = skb_header_pointer(skb, 0, sizeof(struct iphdr), &packet->_iph);
+  if (packet->iph == NULL || packet->iph->ihl < 5)
+    return -1;
+
+  packet->ip_hdr_len = packet->iph->ihl * 4;
+  if (packet->iph->protocol != IPPROTO_TCP)
+    return 0;
+
+  packet->tcph = skb_header_pointer(skb, packet->ip_hdr_len, sizeof(struct tcphdr), &packet->_tcph);
+  if (packet->tcph == NULL || packet->tcph->doff < 5)
+    return -1;
+
+  packet->tcp_hdr_len = packet->tcph->doff * 4;
+  if (skb->len < packet->ip_hdr_len + packet->tcp_hdr_len)
+    return -1;
+
+  packet->payload = skb->len - packet->ip_hdr_len - packet->tcp_hdr_len;
+  packet->segments = packet_segments(skb, packet->payload);
+  if (skb_is_gso(skb))
+    packet->segment_size = skb_shinfo(skb)->gso_size;
+
+  return 0;
+}
+
+/**
+ * TCP Options
+ *
+ * The options a side announces in its SYN or SYN-ACK.
+ * 'flags' tells which of them were present.
+ */
+#define TM_TCPOPT_MSS		0x01
+#define TM_TCPOPT_WSCALE	0x02
+#define TM_TCPOPT_SACK_PERM	0x04
+#define TM_TCPOPT_TIMESTAMP	0x08
+
+struct tm_tcp_options {
+  u_int16_t mss;
+  u_int8_t wscale;
+  u_int8_t flags;
+};
+
+/*
+ * Read the options of a parsed TCP packet. Malformed
+ * options end the parsing, what was read until then is
+ * kept.
+ */
+static inline void parse_tcp_options(struct sk_buff *skb, const struct tm_packet *packet,
+                                     struct tm_tcp_options *options)
+{
+  u_int8_t buf[MAX_TCP_OPTION_SPACE];
+  const u_int8_t *ptr;
+  int len = packet->tcp_hdr_len - sizeof(struct tcphdr);
+
+  memset(options, 0, sizeof(*options));
+  if (len <= 0)
+    return;
+
+  ptr = skb_header_pointer(skb, packet->ip_hdr_len + sizeof(struct tcphdr), len, buf);
+  if (ptr == NULL)
+    return;
+
+  while (len > 0) {
+    int opcode = *ptr++;
+    int opsize;
+
+    if (opcode == TCPOPT_EOL)
+      return;
+    if (opcode == TCPOPT_NOP) {
+      len--;
+      continue;
+    }
+
+    if (len < 2)
+      return;
+    opsize = *ptr++;
+    if (opsize < 2 || opsize > len)
+      return;
+
+    switch (opcode) {
+    case TCPOPT_MSS:
+      if (opsize == TCPOLEN_MSS) {
+        options->mss = get_unaligned_be16(ptr);
+        options->flags |= TM_TCPOPT_MSS;
+      }
+      break;
+    case TCPOPT_WINDOW:
+      if (opsize == TCPOLEN_WINDOW) {
+        options->wscale = min_t(u_int8_t, *ptr, 14);	// RFC 1323 limit
+        options->flags |= TM_TCPOPT_WSCALE;
+      }
+      break;
+    case TCPOPT_SACK_PERM:
+      if (opsize == TCPOLEN_SACK_PERM)
+        options->flags |= TM_TCPOPT_SACK_PERM;
+      break;
+    case TCPOPT_TIMESTAMP:
+      if (opsize == TCPOLEN_TIMESTAMP)
+        options->flags |= TM_TCPOPT_TIMESTAMP;
+      break;
+    }
+
+    ptr += opsize - 2;
+    len -= opsize;
+  }
+}
+
+#endif /* PACKET_H_ */
@@ -0,0 +1,211 @@
+/* 
+ * This file is part of TrafficMonitor.
+ * 
+ * Copyright (C) 2011, Ahmad Nazir, Mohammad Hoque, Wei Li and Aki Saarinen.
+ * 
+ * TrafficMonitor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * TrafficMonitor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with TrafficMonitor.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef RINGBUF_H_
+#define RINGBUF_H_
+
+#include <linux/debugfs.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/moduleparam.h>
+#include <linux/percpu.h>
+#include <linux/poll.h>
+#include <linux/vmalloc.h>
+#include <linux/wait.h>
+
+#include "events.h"
+#include "clock.h"
+
+/**
+ * Ring Capture Mode
+ *
+ * With ring_pages set, every event is written into a
+ * ring buffer of the current CPU instead of a netlink
+ * message, and the reader mmaps the rings from debugfs
+ * (see struct tm_ring_header in events.h). There are no
+ * system calls per event, the reader only polls when a
+ * ring runs empty.
+ *
+ * Each ring is one vmalloc_user() area: the header page
+ * followed by ring_pages pages of event slots. A ring is
+ * only written on its own CPU with the bottom halves
+ * disabled, so the writer needs no lock; the reader and
+ * the writer synchronize through head and tail only.
+ *
+ * The header page is writable by the reader, so the
+ * module never trusts what it reads back from it: head
+ * and size are kept in struct tm_ring and head is only
+ * copied out, and a tail out of range counts as a full
+ * ring.
+ *
+ * The rings are allocated on module load, ring_pages
+ * can not be changed afterwards.
+ */
+static unsigned int ring_pages = 0;
+module_param(ring_pages, uint, 0444);
+MODULE_PARM_DESC(ring_pages, "Write the events into mmapable per CPU rings of this many pages instead of netlink, 0 disables");
+
+struct tm_ring {
+  struct tm_ring_header *header;	// start of the vmalloc_user() area
+  struct tm_event *slots;
+  u_int32_t head;					// the real head, header->head is a copy
+  u_int32_t size;					// slots in the ring
+  unsigned long area_size;
+  wait_queue_head_t wait;			// readers in poll()
+  struct dentry *file;
+};
+
+static DEFINE_PER_CPU(struct tm_ring, tm_rings);
+static struct dentry *ring_dir = NULL;
+
+static inline bool ring_capture(void)
+{
+  return ring_pages > 0;
+}
+
+/*
+ * Reserve the next free slot of the ring, or return
+ * NULL and count a drop if the ring is full. The slot
+ * becomes visible to the reader in ring_commit().
+ */
+static inline struct tm_event * ring_reserve(struct tm_ring *ring)
+{
+  struct tm_ring_header *header = ring->header;
+  u_int32_t tail = ACCESS_ONCE(header->tail);
+  u_int32_t next = (ring->head + 1 == ring->size) ? 0 : ring->head + 1;
+
+  if (tail >= ring->size || next == tail) {
+    header->dropped++;
+    return NULL;
+  }
+
+  smp_mb();			// the reader is done with the slot
+  return &ring->slots[ring->head];
+}
+
+static inline void ring_commit(struct tm_ring *ring)
+{
+  ring->head = (ring->head + 1 == ring->size) ? 0 : ring->head + 1;
+
+  smp_wmb();		// the slot is written before head moves
+  ring->header->head = ring->head;
+
+  smp_mb();
+  if (waitqueue_active(&ring->wait))
+    wake_up_interruptible(&ring->wait);
+}
+
+static int ring_open(struct inode *inode, struct file *file)
+{
+  file->private_data = inode->i_private;
+  return 0;
+}
+
+static int ring_mmap(struct file *file, struct vm_area_struct *vma)
+{
+  struct tm_ring *ring = file->private_data;
+
+  if (vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start > ring->area_size)
+    return -EINVAL;
+
+  return remap_vmalloc_range(vma, ring->header, 0);
+}
+
+static unsigned int ring_poll(struct file *file, poll_table *wait)
+{
+  struct tm_ring *ring = file->private_data;
+
+  poll_wait(file, &ring->wait, wait);
+
+  // a tail out of range never equals head, the ring is full then
+  if (ring->head != ACCESS_ONCE(ring->header->tail))
+    return POLLIN | POLLRDNORM;
+  return 0;
+}
+
+static const struct file_operations ring_fops = {
+  .owner = THIS_MODULE,
+  .open = ring_open,
+  .mmap = ring_mmap,
+  .poll = ring_poll,
+};
+
+static void destroy_rings(void)
+{
+  int cpu;
+
+  debugfs_remove_recursive(ring_dir);
+  ring_dir = NULL;
+
+  for_each_possible_cpu(cpu) {
+    struct tm_ring *ring = &per_cpu(tm_rings, cpu);
+
+    vfree(ring->header);
+    ring->header = NULL;
+  }
+}
+
+/*
+ * Allocate the rings and create the files under
+ * 'parent'. Nothing to do unless ring capture was
+ * asked for.
+ */
+static int init_rings(struct dentry *parent)
+{
+  int cpu;
+
+  if (!ring_capture())
+    return 0;
+
+  ring_dir = debugfs_create_dir("ring", parent);
+  if (ring_dir == NULL)
+    return -ENOMEM;
+
+  for_each_possible_cpu(cpu) {
+    struct tm_ring *ring = &per_cpu(tm_rings, cpu);
+    char name[16];
+
+    ring->area_size = (unsigned long) (ring_pages + 1) << PAGE_SHIFT;
+    ring->header = vmalloc_user(ring->area_size);
+    if (ring->header == NULL) {
+      destroy_rings();
+      return -ENOMEM;
+    }
+
+    ring->header->data_offset = PAGE_SIZE;
+    ring->size = ((unsigned long) ring_pages << PAGE_SHIFT) / sizeof(struct tm_event);
+    ring->header->size = ring->size;
+    ring->slots = (struct tm_event *) ((char *) ring->header + PAGE_SIZE);
+    init_waitqueue_head(&ring->wait);
+
+    // the first record lets the reader align the events with the wall clock
+    fill_clock_event(&ring->slots[0]);
+    ring->head = 1;
+    ring->header->head = ring->head;
+
+    snprintf(name, sizeof(name), "cpu%d", cpu);
+    ring->file = debugfs_create_file(name, 0400, ring_dir, ring, &ring_fops);
+  }
+
+  printk(KERN_INFO "TM :: Ring capture enabled, %u events per CPU\n",
+         per_cpu(tm_rings, 0).size);
+  return 0;
+}
+
+#endif /* RINGBUF_H_ */
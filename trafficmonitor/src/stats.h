@@ -0,0 +1,148 @@
+/* 
+ * This file is part of TrafficMonitor.
+ * 
+ * Copyright (C) 2011, Ahmad Nazir, Mohammad Hoque, Wei Li and Aki Saarinen.
+ * 
+ * TrafficMonitor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * TrafficMonitor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with TrafficMonitor.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <linux/debugfs.h>
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
+#include <asm/local.h>
+
+/**
+ * Statistics
+ *
+ * Counters of what the module itself does, to see its
+ * overhead and its losses during a run. Every CPU has
+ * its own counters, so counting never bounces a cache
+ * line between the CPUs; they are only summed up when
+ * /sys/kernel/debug/trafficmonitor/stats is read. The
+ * counters are local_t, so a hook interrupted by a
+ * softirq on the same CPU does not lose a count.
+ */
+enum tm_stat {
+  TM_STAT_IN_PACKETS,			// all IPv4 packets seen by the local in hook
+  TM_STAT_IN_SEGMENTS,			// the same on the wire, a GRO packet counts as its segments
+  TM_STAT_IN_BYTES,
+  TM_STAT_IN_TCP,
+  TM_STAT_IN_OTHER,				// not TCP, let through untouched
+  TM_STAT_OUT_PACKETS,			// same for the local out hook
+  TM_STAT_OUT_SEGMENTS,
+  TM_STAT_OUT_BYTES,
+  TM_STAT_OUT_TCP,
+  TM_STAT_OUT_OTHER,
+  TM_STAT_TRUNCATED,			// headers cut short, let through untouched
+  TM_STAT_LOOKUPS,				// connection table lookups
+  TM_STAT_LOOKUP_MISSES,
+  TM_STAT_CONNECTIONS_CREATED,
+  TM_STAT_CONNECTIONS_REAPED,
+  TM_STAT_EVENTS_EMITTED,		// written into a ring or an event queue
+  TM_STAT_EVENTS_DROPPED,		// ring or queue full, or no memory for a batch
+  TM_STAT_NETLINK_FAILURES,		// batches the netlink core refused
+  TM_STAT_REWRITE_FAILURES,		// windows not rewritten, no memory to unshare the header
+  TM_STAT_MAX
+};
+
+static const char * const tm_stat_names[TM_STAT_MAX] = {
+  [TM_STAT_IN_PACKETS] = "in_packets",
+  [TM_STAT_IN_SEGMENTS] = "in_segments",
+  [TM_STAT_IN_BYTES] = "in_bytes",
+  [TM_STAT_IN_TCP] = "in_tcp",
+  [TM_STAT_IN_OTHER] = "in_other",
+  [TM_STAT_OUT_PACKETS] = "out_packets",
+  [TM_STAT_OUT_SEGMENTS] = "out_segments",
+  [TM_STAT_OUT_BYTES] = "out_bytes",
+  [TM_STAT_OUT_TCP] = "out_tcp",
+  [TM_STAT_OUT_OTHER] = "out_other",
+  [TM_STAT_TRUNCATED] = "truncated",
+  [TM_STAT_LOOKUPS] = "lookups",
+  [TM_STAT_LOOKUP_MISSES] = "lookup_misses",
+  [TM_STAT_CONNECTIONS_CREATED] = "connections_created",
+  [TM_STAT_CONNECTIONS_REAPED] = "connections_reaped",
+  [TM_STAT_EVENTS_EMITTED] = "events_emitted",
+  [TM_STAT_EVENTS_DROPPED] = "events_dropped",
+  [TM_STAT_NETLINK_FAILURES] = "netlink_failures",
+  [TM_STAT_REWRITE_FAILURES] = "rewrite_failures",
+};
+
+struct tm_stats {
+  local_t count[TM_STAT_MAX];
+};
+
+static DEFINE_PER_CPU(struct tm_stats, tm_stats);
+static struct dentry *stats_file = NULL;
+
+static inline void tm_stat_add(enum tm_stat stat, unsigned long n)
+{
+  local_add(n, &get_cpu_var(tm_stats).count[stat]);
+  put_cpu_var(tm_stats);
+}
+
+static inline void tm_stat_inc(enum tm_stat stat)
+{
+  local_inc(&get_cpu_var(tm_stats).count[stat]);
+  put_cpu_var(tm_stats);
+}
+
+static unsigned long tm_stat_sum(enum tm_stat stat)
+{
+  unsigned long sum = 0;
+  int cpu;
+
+  for_each_possible_cpu(cpu)
+    sum += local_read(&per_cpu(tm_stats, cpu).count[stat]);
+
+  return sum;
+}
+
+static int stats_show(struct seq_file *m, void *v)
+{
+  int stat;
+
+  for (stat = 0; stat < TM_STAT_MAX; stat++)
+    seq_printf(m, "%s %lu\n", tm_stat_names[stat], tm_stat_sum(stat));
+
+  return 0;
+}
+
+static int stats_open(struct inode *inode, struct file *file)
+{
+  return single_open(file, stats_show, NULL);
+}
+
+static const struct file_operations stats_fops = {
+  .owner = THIS_MODULE,
+  .open = stats_open,
+  .read = seq_read,
+  .llseek = seq_lseek,
+  .release = single_release,
+};
+
+static void init_stats(struct dentry *parent)
+{
+  stats_file = debugfs_create_file("stats", 0444, parent, NULL, &stats_fops);
+}
+
+static void destroy_stats(void)
+{
+  debugfs_remove(stats_file);
+  stats_file = NULL;
+}
+
+#endif /* STATS_H_ */
@@ -0,0 +1,171 @@
+/* 
+ * This file is part of TrafficMonitor.
+ * 
+ * Copyright (C) 2011, Ahmad Nazir, Mohammad Hoque, Wei Li and Aki Saarinen.
+ * 
+ * TrafficMonitor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * TrafficMonitor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with TrafficMonitor.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Tracepoints
+ *
+ * The diagnostics of the hooks and the timers go
+ * through the ftrace ring buffer, which costs next to
+ * nothing while a tracepoint is disabled. They show up
+ * under /sys/kernel/debug/tracing/events/trafficmonitor/:
+ *
+ *  tm_packet		a packet seen by the hooks, what print_packet_info() used to print
+ *  tm_burst_stage	the burst stage of a connection changes
+ *  tm_choke		the receive window of a connection is set to zero or restored
+ *  tm_timer		one of the timers of a connection fires
+ *
+ * The old dmesg lines are still printed with the
+ * dmesg_compat module parameter, for the packets only
+ * while the display_burst_stage diagnostics (common.h)
+ * are on.
+ *
+ * Included from ec.c only, which defines
+ * CREATE_TRACE_POINTS. The Makefile adds the source
+ * directory to the include path for define_trace.h.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM trafficmonitor
+
+#if !defined(TM_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define TM_TRACE_H_
+
+#include <linux/tracepoint.h>
+
+#define show_burst_stage(stage)			\
+  __print_symbolic(stage,				\
+                   { 0, "no_connection" },	\
+                   { 1, "syn" },			\
+                   { 2, "syn_ack" },		\
+                   { 3, "established" },	\
+                   { 4, "request" },		\
+                   { 5, "start" },			\
+                   { 6, "fin" })
+
+TRACE_EVENT(tm_packet,
+
+  TP_PROTO(u32 connection_id, int direction, const char *type,
+           u32 ack, u32 seq, unsigned int size),
+
+  TP_ARGS(connection_id, direction, type, ack, seq, size),
+
+  TP_STRUCT__entry(
+    __field(u32, connection_id)
+    __field(int, direction)
+    __string(type, type)
+    __field(u32, ack)
+    __field(u32, seq)
+    __field(unsigned int, size)
+  ),
+
+  TP_fast_assign(
+    __entry->connection_id = connection_id;
+    __entry->direction = direction;
+    __assign_str(type, type);
+    __entry->ack = ack;
+    __entry->seq = seq;
+    __entry->size = size;
+  ),
+
+  TP_printk("%s %u %s, ack %u, seq %u, size %u",
+            __entry->direction == 0 ? "<=" : "=>",
+            __entry->connection_id, __get_str(type),
+            __entry->ack, __entry->seq, __entry->size)
+);
+
+TRACE_EVENT(tm_burst_stage,
+
+  TP_PROTO(u32 connection_id, u8 old_stage, u8 new_stage),
+
+  TP_ARGS(connection_id, old_stage, new_stage),
+
+  TP_STRUCT__entry(
+    __field(u32, connection_id)
+    __field(u8, old_stage)
+    __field(u8, new_stage)
+  ),
+
+  TP_fast_assign(
+    __entry->connection_id = connection_id;
+    __entry->old_stage = old_stage;
+    __entry->new_stage = new_stage;
+  ),
+
+  TP_printk("%u %s -> %s", __entry->connection_id,
+            show_burst_stage(__entry->old_stage),
+            show_burst_stage(__entry->new_stage))
+);
+
+TRACE_EVENT(tm_choke,
+
+  TP_PROTO(u32 connection_id, bool choke, u32 window_size, u16 window_scale),
+
+  TP_ARGS(connection_id, choke, window_size, window_scale),
+
+  TP_STRUCT__entry(
+    __field(u32, connection_id)
+    __field(bool, choke)
+    __field(u32, window_size)
+    __field(u16, window_scale)
+  ),
+
+  TP_fast_assign(
+    __entry->connection_id = connection_id;
+    __entry->choke = choke;
+    __entry->window_size = window_size;
+    __entry->window_scale = window_scale;
+  ),
+
+  TP_printk("%u %s, window %u, scale %u", __entry->connection_id,
+            __entry->choke ? "choke" : "restore",
+            __entry->window_size, __entry->window_scale)
+);
+
+TRACE_EVENT(tm_timer,
+
+  TP_PROTO(u32 connection_id, const char *timer, u16 state, u16 choke_state, u16 psmt_state),
+
+  TP_ARGS(connection_id, timer, state, choke_state, psmt_state),
+
+  TP_STRUCT__entry(
+    __field(u32, connection_id)
+    __string(timer, timer)
+    __field(u16, state)
+    __field(u16, choke_state)
+    __field(u16, psmt_state)
+  ),
+
+  TP_fast_assign(
+    __entry->connection_id = connection_id;
+    __assign_str(timer, timer);
+    __entry->state = state;
+    __entry->choke_state = choke_state;
+    __entry->psmt_state = psmt_state;
+  ),
+
+  TP_printk("%u %s, state %u, choke_state %u, psmt_state %u",
+            __entry->connection_id, __get_str(timer),
+            __entry->state, __entry->choke_state, __entry->psmt_state)
+);
+
+#endif /* TM_TRACE_H_ */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#define TRACE_INCLUDE_FILE tm_trace
+#include <trace/define_trace.h>